@@ -0,0 +1,529 @@
+#ifndef BLOCKHIPSTREE_H
+#define BLOCKHIPSTREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "LeafHandle.h"
+#include "Mixing.h"
+#include "ThreadPool.h"
+#include "randomGenerator.h"
+
+/*
+ * Block tree class
+ *
+ * The layout shared by HybridHipsTree and MappedHipsTree. The leaves are cut into blocks of consecutive leaves, one
+ * block for every node at the block level, and the levels above are only a table saying which block holds each of
+ * those nodes. A swap at or above the block level exchanges entries of that table, a swap below it swaps leaves
+ * inside one block. The most a swap moves is half a block, and reading the leaves in order streams through whole
+ * blocks.
+ *
+ * The block level follows from the depth and sizeof(T): blocks get the largest power of 2 leaves that fit in
+ * blockBytes (at least 4, so the parcels a grandchild swap mixes share a block) and the table gets the levels above.
+ * The random branch choices are drawn in the same order as FlatHipsTree so both give the same leaf order for the same
+ * seed and generator policy.
+ *
+ * Where the leaves live is up to the storage policy, which has to provide
+ *   T* allocate(size_t count)              room for count leaves, dropping the old ones
+ *   T* adopt(std::vector<T>&& values)      the leaves become values
+ *   std::vector<T> extract()               the leaves in storage order, the storage is left empty
+ *   void release()                         drops the leaves
+ *   void flush()                           makes sure changed leaves are stored
+ *   void prefetch(const T* first, size_t count)  hints that the leaves are about to be read
+ */
+template <typename T, typename Storage, typename Rng=randomGenerator>
+class BlockHipsTree
+{
+public:
+	/*
+	 * Constructor, storageArgs are passed on to the storage
+	 */
+	template <typename... Args>
+	BlockHipsTree(int randSeed, size_t blockBytes, Args&&... storageArgs)
+		: storage(std::forward<Args>(storageArgs)...), blockBytes(blockBytes), random(randSeed)
+	{
+	}
+	BlockHipsTree(const BlockHipsTree&) = delete;
+	BlockHipsTree& operator=(const BlockHipsTree&) = delete;
+	/*
+	 * Populates the tree with a vector of leaves - the vector should be a power of 2
+	 */
+	void populateByVector(const std::vector<T>& values)
+	{
+		populateByRange(values.begin(), values.end());
+	}
+	/*
+	 * Same as above but hands the vector to the storage, which takes it over if it keeps leaves in memory
+	 */
+	void populateByVector(std::vector<T>&& values)
+	{
+		if (!isPowerOfTwo(values.size()))
+			throw std::runtime_error("Vector of values is not a power of 2 in size");
+		layOut(levelsForLeaves(values.size()));
+		leaves = storage.adopt(std::move(values));
+		values.clear();
+	}
+	/*
+	 * Populates the tree with the values in [first, last)
+	 */
+	template <typename It>
+	void populateByRange(It first, It last)
+	{
+		size_t count = (size_t) std::distance(first, last);
+		if (!isPowerOfTwo(count))
+			throw std::runtime_error("Vector of values is not a power of 2 in size");
+		layOut(levelsForLeaves(count));
+		leaves = storage.allocate(count);
+		std::copy(first, last, leaves);
+	}
+	/*
+	 * Populates the tree to a given number of layers filling the leaves with a given value
+	 */
+	void populateToLevelValue(size_t level, const T& value)
+	{
+		layOut(level);
+		leaves = storage.allocate(leafCount);
+		std::fill(leaves, leaves + leafCount, value);
+	}
+	/*
+	 * Creates a tree to a given number of layers with value initialized leaves
+	 */
+	void populateToLevel(size_t level)
+	{
+		layOut(level);
+		leaves = storage.allocate(leafCount);
+	}
+	/*
+	 * Removes all leaves and makes tree have size 0
+	 */
+	void resetTree()
+	{
+		layOut(0);
+		storage.release();
+		leaves = nullptr;
+	}
+	/*
+	 * Makes sure changed leaves are stored (writes them back to the file for a mapped tree)
+	 */
+	void flush()
+	{
+		storage.flush();
+	}
+	/*
+	 * Moves the blocks so they are in order (the table is the identity after), every block that is out of place is
+	 * moved once through a buffer of one block
+	 */
+	void materialize()
+	{
+		std::vector<T> buffer;
+		for (size_t start = 0; start < blockOf.size(); start++)
+		{
+			if (blockOf[start] == start)
+				continue;
+			// follow the cycle of blocks through start, each block moves to where its table entry points from
+			buffer.assign(std::make_move_iterator(block(start)), std::make_move_iterator(block(start) + blockSize));
+			size_t slot = start;
+			while (blockOf[slot] != start)
+			{
+				size_t from = blockOf[slot];
+				std::move(block(from), block(from) + blockSize, block(slot));
+				blockOf[slot] = slot;
+				slot = from;
+			}
+			std::move(buffer.begin(), buffer.end(), block(slot));
+			blockOf[slot] = slot;
+		}
+	}
+	/*
+	 * Gets a vector of copies of the values of the leaves
+	 */
+	std::vector<T> inOrderValues()
+	{
+		std::vector<T> values;
+		snapshot(values);
+		return values;
+	}
+	/*
+	 * Copies the values of the leaves in order into out, which needs room for every leaf. With a pool the blocks are
+	 * copied by its threads.
+	 */
+	void snapshot(T* out, ThreadPool* pool=nullptr)
+	{
+		auto copyBlock = [&](size_t slot) {
+			const T* first = block(blockOf[slot]);
+			storage.prefetch(first, blockSize);
+			std::copy(first, first + blockSize, out + slot * blockSize);
+		};
+		if (pool != nullptr)
+		{
+			pool->parallelFor(blockOf.size(), copyBlock);
+		}
+		else
+		{
+			for (size_t slot = 0; slot < blockOf.size(); slot++)
+				copyBlock(slot);
+		}
+	}
+	/*
+	 * Same as above into a vector that is resized to the number of leaves (reusing a vector avoids allocating)
+	 */
+	void snapshot(std::vector<T>& buffer, ThreadPool* pool=nullptr)
+	{
+		buffer.resize(leafCount);
+		snapshot(buffer.data(), pool);
+	}
+	/*
+	 * Moves the leaves out in order and leaves the tree empty (without copying when the storage is in memory)
+	 */
+	std::vector<T> extractValues()
+	{
+		materialize();
+		std::vector<T> values = storage.extract();
+		resetTree();
+		return values;
+	}
+	/*
+	 * Gets a vector of handles to the leaves (used like HipsTree's leaf nodes)
+	 */
+	std::vector<LeafHandle<T>> inOrderLeaves()
+	{
+		std::vector<LeafHandle<T>> handles;
+		handles.reserve(leafCount);
+		for (auto& leaf : *this)
+			handles.emplace_back(&leaf);
+		return handles;
+	}
+	/*
+	 * Chooses a random level and then random branches until it reaches that level, eventually switching the left and
+	 * right children of a node
+	 */
+	void swapRandom()
+	{
+		swapBranchesAt(walkToLevel(random.getRandInt(depth - 2)));
+	}
+	/*
+	 * Uses random branches to reach a specified level then swaps those branches
+	 */
+	void swapRandomLevel(size_t level)
+	{
+		if (level > depth - 1)
+			throw std::runtime_error("Level too deep for swap");
+		swapBranchesAt(walkToLevel(level));
+	}
+	/*
+	 * Swap grandchildren as used by hips code
+	 */
+	void swapRandomGrandchildrenLevel(size_t level)
+	{
+		if (level > depth - 2)
+			throw std::runtime_error("Level too deep for grandchild swap");
+		swapGrandchildrenAt(walkToLevel(level));
+	}
+	/*
+	 * Does swap event number index with its branches drawn from the generator's stream for that event, so the result
+	 * does not depend on any other event (needs a counter based generator like PhiloxRandom)
+	 */
+	void swapEvent(uint64_t index, size_t level, bool grandchild)
+	{
+		random.beginEvent(index, (uint32_t) level);
+		if (grandchild)
+			swapRandomGrandchildrenLevel(level);
+		else
+			swapRandomLevel(level);
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a built in rule
+	 */
+	void setMixingRule(MixingRule rule, double fraction=1.0)
+	{
+		mixer.setRule(rule, fraction);
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a function
+	 */
+	void setMixingHook(std::function<void(T&, T&)> hook)
+	{
+		mixer.setHook(std::move(hook));
+	}
+	/*
+	 * Returns the generator the tree draws its branches from
+	 */
+	Rng& getRandomGenerator()
+	{
+		return random;
+	}
+	/*
+	 * Returns the current depth of the tree in layers
+	 */
+	size_t getDepth()
+	{
+		return depth;
+	}
+	/*
+	 * Returns the level whose nodes each own one block, the levels above it are the table
+	 */
+	size_t getBlockLevel()
+	{
+		return blockLevel;
+	}
+	/*
+	 * Returns the number of leaves in a block
+	 */
+	size_t getBlockSize()
+	{
+		return blockSize;
+	}
+	/*
+	 * Returns the storage the leaves are kept in
+	 */
+	Storage& getStorage()
+	{
+		return storage;
+	}
+	/*
+	 * Returns the leaf at a position
+	 */
+	T& leafAt(size_t index)
+	{
+		if (index >= leafCount)
+			throw std::out_of_range("Leaf index out of range");
+		return *leafPointer(index);
+	}
+
+	/*
+	 * Leaf iterator class goes over the values of the leaves in order, it only looks at the table between blocks
+	 */
+	class LeafIterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = T;
+		using difference_type = std::ptrdiff_t;
+		using pointer = T*;
+		using reference = T&;
+
+		LeafIterator(BlockHipsTree* tree, size_t index) : tree(tree), index(index)
+		{
+			if (index < tree->leafCount)
+			{
+				current = tree->leafPointer(index);
+				blockEnd = current + (tree->blockSize - (index & (tree->blockSize - 1)));
+			}
+		}
+
+		reference operator*() const
+		{
+			return *current;
+		}
+		pointer operator->() const
+		{
+			return current;
+		}
+		LeafIterator& operator++()
+		{
+			index++;
+			if (++current == blockEnd && index < tree->leafCount)
+			{
+				current = tree->leafPointer(index);
+				blockEnd = current + tree->blockSize;
+			}
+			return *this;
+		}
+		LeafIterator operator++(int)
+		{
+			LeafIterator before = *this;
+			++*this;
+			return before;
+		}
+		bool operator==(const LeafIterator& other) const
+		{
+			return index == other.index;
+		}
+		bool operator!=(const LeafIterator& other) const
+		{
+			return index != other.index;
+		}
+
+	private:
+		BlockHipsTree* tree;
+		size_t index;
+		T* current = nullptr;
+		T* blockEnd = nullptr;
+	};
+
+	/*
+	 * Tree iterator class allows traversing the leaves of the tree
+	 */
+	class TreeIterator
+	{
+	public:
+		TreeIterator(LeafIterator first, LeafIterator last) : current(first), end(last) {}
+
+		LeafHandle<T> next()
+		{
+			if (!hasNext())
+				return nullptr;
+			return LeafHandle<T>(&*current++);
+		}
+
+		bool hasNext()
+		{
+			return current != end;
+		}
+
+	private:
+		LeafIterator current;
+		LeafIterator end;
+	};
+
+	using iterator = LeafIterator;
+
+	/*
+	 * Iterators over the values of the leaves in order
+	 */
+	iterator begin()
+	{
+		return LeafIterator(this, 0);
+	}
+	iterator end()
+	{
+		return LeafIterator(this, leafCount);
+	}
+
+	/*
+	 * Returns an iterator that will start at the first leaf
+	 */
+	TreeIterator getIterator()
+	{
+		return TreeIterator(begin(), end());
+	}
+	/*
+	 * Returns a string of the values of the leaves in order
+	 */
+	std::string toString(const std::string& sep=", ")
+	{
+		std::stringstream ss;
+		std::string se;
+		for (const auto& leaf : *this)
+		{
+			ss << se << leaf;
+			se = sep;
+		}
+		return ss.str();
+	}
+
+private:
+	/*
+	 * Various helper functions and members
+	 */
+
+	// first leaf and number of leaves under a node, counted in the tree's order and not the storage's
+	struct Block
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	Block walkToLevel(size_t level)
+	{
+		Block node{0, leafCount};
+		for (size_t i = 0; i < level; i++)
+		{
+			node.size /= 2;
+			if (!random.getRandInt(1))
+				node.offset += node.size;
+		}
+		return node;
+	}
+	void swapBranchesAt(Block node)
+	{
+		size_t half = node.size / 2;
+		swapLeaves(node.offset, node.offset + half, half);
+	}
+	void swapGrandchildrenAt(Block node)
+	{
+		bool leftGrandchildLeft = random.getRandInt(1);
+		bool rightGrandchildLeft = random.getRandInt(1);
+		size_t quarter = node.size / 4;
+		size_t leftGrandchild = node.offset + (leftGrandchildLeft ? 0 : quarter);
+		size_t rightGrandchild = node.offset + 2 * quarter + (rightGrandchildLeft ? 0 : quarter);
+		swapLeaves(leftGrandchild, rightGrandchild, quarter);
+		// blocks hold at least 4 leaves so the two new pairs of parcels are in one block
+		if (quarter == 1 && mixer.isActive())
+			mixer.mixAdjacentPairs(leafPointer(node.offset), 2);
+	}
+	// count is a power of 2 and first and second are multiples of it, so a range is whole blocks or inside one block
+	void swapLeaves(size_t first, size_t second, size_t count)
+	{
+		if (count >= blockSize)
+			std::swap_ranges(blockOf.begin() + (first >> blockShift), blockOf.begin() + ((first + count) >> blockShift),
+			                 blockOf.begin() + (second >> blockShift));
+		else
+			std::swap_ranges(leafPointer(first), leafPointer(first) + count, leafPointer(second));
+	}
+	T* leafPointer(size_t index) const
+	{
+		return block(blockOf[index >> blockShift]) + (index & (blockSize - 1));
+	}
+	T* block(size_t stored) const
+	{
+		return leaves + stored * blockSize;
+	}
+	/*
+	 * Picks the block size for a tree of a given depth and lays the blocks out in order
+	 */
+	void layOut(size_t level)
+	{
+		depth = level;
+		leafCount = level > 0 ? (size_t) 1 << (level - 1) : 0;
+		blockOf.clear();
+		if (leafCount == 0)
+		{
+			blockShift = blockSize = blockLevel = 0;
+			return;
+		}
+		blockShift = 2;
+		while (((size_t) 2 << blockShift) * sizeof(T) <= blockBytes)
+			blockShift++;
+		while (((size_t) 1 << blockShift) > leafCount)
+			blockShift--;
+		blockSize = (size_t) 1 << blockShift;
+		blockLevel = depth - 1 - blockShift;
+		blockOf.resize(leafCount >> blockShift);
+		for (size_t i = 0; i < blockOf.size(); i++)
+			blockOf[i] = i;
+	}
+	static size_t levelsForLeaves(size_t count)
+	{
+		size_t level = 1;
+		while (((size_t) 1 << (level - 1)) < count)
+			level++;
+		return level;
+	}
+	static bool isPowerOfTwo(size_t n)
+	{
+		return n != 0 && (n & (n - 1)) == 0;
+	}
+
+	Storage storage;
+	size_t blockBytes;
+	T* leaves = nullptr;
+	size_t leafCount = 0;
+	// block of the storage holding node i at the block level (counted from the left)
+	std::vector<size_t> blockOf;
+	size_t blockShift = 0;
+	size_t blockSize = 0;
+	size_t blockLevel = 0;
+	MixingKernel<T> mixer;
+	size_t depth = 0;
+	Rng random;
+};
+
+#endif //BLOCKHIPSTREE_H
@@ -0,0 +1,194 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+/*
+ * Binary checkpoints
+ *
+ * A tree is always perfect, so its depth and the leaves in order describe it completely. Together with the state of
+ * the tree's generator that is enough for a restarted run to continue with exactly the same swaps. Works with any tree
+ * that has begin/end, getDepth, populateByVector, resetTree and getRandomGenerator (HipsTree, FlatHipsTree,
+ * HybridHipsTree and MappedHipsTree). The mixing rule and lazy swap setting are configuration and are not saved.
+ *
+ * Layout (native byte order):
+ *   CheckpointHeader
+ *   generator state, header.rngWords 32 bit words
+ *   zero padding up to header.dataOffset (a multiple of 4096 so the leaves can be mapped straight from the file)
+ *   the leaves in order, 2^(depth - 1) values of header.valueSize bytes
+ */
+
+struct CheckpointHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t valueSize;
+	uint64_t depth;
+	uint32_t rngWords;
+	// none are defined yet, a reader refuses any it does not know
+	uint32_t flags;
+	uint64_t dataOffset;
+};
+
+static const char checkpointMagic[8] = {'H', 'I', 'P', 'S', 'C', 'K', 'P', 'T'};
+static const uint32_t checkpointVersion = 1;
+static const uint64_t checkpointAlignment = 4096;
+// leaves are read and written this many values at a time
+static const size_t checkpointChunk = (size_t) 1 << 20;
+
+/*
+ * Helper that closes a file when it goes out of scope
+ */
+class CheckpointFile
+{
+public:
+	CheckpointFile(const std::string& path, const char* mode) : file(fopen(path.c_str(), mode))
+	{
+		if (file == nullptr)
+			throw std::runtime_error("Could not open checkpoint file " + path);
+	}
+	CheckpointFile(const CheckpointFile&) = delete;
+	CheckpointFile& operator=(const CheckpointFile&) = delete;
+	~CheckpointFile()
+	{
+		if (file != nullptr)
+			fclose(file);
+	}
+	void write(const void* data, size_t bytes)
+	{
+		if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes)
+			throw std::runtime_error("Could not write checkpoint");
+	}
+	void read(void* data, size_t bytes)
+	{
+		if (bytes > 0 && fread(data, 1, bytes, file) != bytes)
+			throw std::runtime_error("Checkpoint file is truncated");
+	}
+	/*
+	 * Returns the size of the file in bytes, the position is left at the end
+	 */
+	uint64_t size()
+	{
+		long bytes = -1;
+		if (fseek(file, 0, SEEK_END) == 0)
+			bytes = ftell(file);
+		if (bytes < 0)
+			throw std::runtime_error("Could not read checkpoint size");
+		return (uint64_t) bytes;
+	}
+	void seek(uint64_t offset)
+	{
+		if (fseek(file, (long) offset, SEEK_SET) != 0)
+			throw std::runtime_error("Checkpoint file is truncated");
+	}
+	void close()
+	{
+		int result = fclose(file);
+		file = nullptr;
+		if (result != 0)
+			throw std::runtime_error("Could not write checkpoint");
+	}
+
+private:
+	FILE* file;
+};
+
+/*
+ * Writes a checkpoint of a tree to a file
+ */
+template <typename Tree>
+void writeCheckpoint(Tree& tree, const std::string& path)
+{
+	using T = typename std::iterator_traits<typename Tree::iterator>::value_type;
+	using Rng = typename std::remove_reference<decltype(tree.getRandomGenerator())>::type;
+	static_assert(std::is_trivially_copyable<T>::value, "Checkpoints need a trivially copyable value type");
+
+	CheckpointHeader header{};
+	memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+	header.version = checkpointVersion;
+	header.valueSize = sizeof(T);
+	header.depth = tree.getDepth();
+	header.rngWords = Rng::stateSize;
+	size_t headerBytes = sizeof(header) + header.rngWords * sizeof(uint32_t);
+	header.dataOffset = (headerBytes + checkpointAlignment - 1) / checkpointAlignment * checkpointAlignment;
+
+	std::vector<uint32_t> state(header.rngWords);
+	tree.getRandomGenerator().save(state.data());
+
+	CheckpointFile file(path, "wb");
+	file.write(&header, sizeof(header));
+	file.write(state.data(), state.size() * sizeof(uint32_t));
+	std::vector<char> padding(header.dataOffset - headerBytes, 0);
+	file.write(padding.data(), padding.size());
+
+	std::vector<T> chunk;
+	chunk.reserve(checkpointChunk);
+	for (auto it = tree.begin(), end = tree.end(); it != end;)
+	{
+		chunk.clear();
+		for (; it != end && chunk.size() < checkpointChunk; ++it)
+			chunk.push_back(*it);
+		file.write(chunk.data(), chunk.size() * sizeof(T));
+	}
+	file.close();
+}
+
+/*
+ * Replaces a tree and its generator state with a checkpoint read from a file. Everything is read and checked before
+ * the tree is touched, so a bad file throws and leaves the tree as it was.
+ */
+template <typename Tree>
+void readCheckpoint(Tree& tree, const std::string& path)
+{
+	using T = typename std::iterator_traits<typename Tree::iterator>::value_type;
+	using Rng = typename std::remove_reference<decltype(tree.getRandomGenerator())>::type;
+	static_assert(std::is_trivially_copyable<T>::value, "Checkpoints need a trivially copyable value type");
+
+	CheckpointFile file(path, "rb");
+	CheckpointHeader header;
+	file.read(&header, sizeof(header));
+	if (memcmp(header.magic, checkpointMagic, sizeof(header.magic)) != 0)
+		throw std::runtime_error("Not a tree checkpoint: " + path);
+	if (header.version != checkpointVersion)
+		throw std::runtime_error("Unsupported checkpoint version");
+	if (header.valueSize != sizeof(T))
+		throw std::runtime_error("Checkpoint was written for a different value type");
+	if (header.rngWords != (uint32_t) Rng::stateSize)
+		throw std::runtime_error("Checkpoint was written with a different generator");
+	if (header.flags != 0)
+		throw std::runtime_error("Checkpoint has flags this version does not know");
+	if (header.depth > 64)
+		throw std::runtime_error("Checkpoint depth is not valid");
+
+	std::vector<uint32_t> state(header.rngWords);
+	file.read(state.data(), state.size() * sizeof(uint32_t));
+	size_t headerBytes = sizeof(header) + header.rngWords * sizeof(uint32_t);
+	if (header.dataOffset < headerBytes || header.dataOffset % checkpointAlignment != 0)
+		throw std::runtime_error("Checkpoint data offset is not valid");
+	uint64_t leafCount = header.depth > 0 ? (uint64_t) 1 << (header.depth - 1) : 0;
+	uint64_t fileBytes = file.size();
+	// compared as a count of leaves so a huge depth cannot overflow the size
+	if (header.dataOffset > fileBytes || leafCount > (fileBytes - header.dataOffset) / sizeof(T))
+		throw std::runtime_error("Checkpoint file is truncated");
+	file.seek(header.dataOffset);
+
+	std::vector<T> values((size_t) leafCount);
+	for (size_t done = 0; done < values.size(); done += checkpointChunk)
+		file.read(values.data() + done, std::min(values.size() - done, checkpointChunk) * sizeof(T));
+
+	if (values.empty())
+		tree.resetTree();
+	else
+		tree.populateByVector(std::move(values));
+	tree.getRandomGenerator().load(state.data());
+}
+
+#endif //CHECKPOINT_H
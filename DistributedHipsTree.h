@@ -0,0 +1,352 @@
+#ifndef DISTRIBUTEDHIPSTREE_H
+#define DISTRIBUTEDHIPSTREE_H
+
+#ifdef DOMPI
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "FastRandom.h"
+#include "Mixing.h"
+#include "randomGenerator.h"
+
+/*
+ * Distributed tree class
+ *
+ * Spreads one tree over the ranks of an MPI communicator, which needs a power of 2 number of ranks (2^split). The top
+ * split levels are replicated: every rank keeps the same table of which rank owns each of the 2^split subtrees (slots)
+ * at the split level. Each rank only stores the leaves of its own subtree, as one flat array like FlatHipsTree.
+ *
+ * Every rank has to make the same calls in the same order. The branches above the split are drawn from a generator
+ * every rank has a copy of, so all ranks take the same walk there.
+ *   A swap below the split only touches the subtree it lands in, its owner does it alone and nothing is sent.
+ *   A swap of whole subtrees above the split only permutes the slot table, nothing is sent either.
+ *   A grandchild swap at split - 1 exchanges half of one rank's leaves with half of its neighbor's.
+ *
+ * The branches below the split are drawn from each rank's own generator, so the result depends on the number of
+ * ranks. With a counter based generator (PhiloxRandom) every swap draws all of its branches from its own event stream
+ * instead, and swap k gives the same tree as swapEvent(k, level, grandchild) on a serial tree with the same seed for
+ * any number of ranks.
+ */
+template <typename T, typename Rng=randomGenerator>
+class DistributedHipsTree
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Leaves are sent as bytes so they have to be trivially copyable");
+
+public:
+	/*
+	 * Creates an empty tree over the ranks of a communicator (MPI has to be initialized, see processor)
+	 */
+	explicit DistributedHipsTree(int randSeed, MPI_Comm comm=MPI_COMM_WORLD)
+		: comm(comm), random(randSeed),
+		  localRandom(isCounterBased<Rng>::value ? randSeed : randSeed + 1 + rankOf(comm))
+	{
+		MPI_Comm_rank(comm, &rank);
+		MPI_Comm_size(comm, &ranks);
+		if (!isPowerOfTwo((size_t) ranks))
+			throw std::runtime_error("A distributed tree needs a power of 2 number of ranks");
+		while (((size_t) 1 << splitLevel) < (size_t) ranks)
+			splitLevel++;
+		resetSlots();
+	}
+	/*
+	 * Populates the tree with this rank's share of the leaves (every rank passes the same power of 2 count of at least
+	 * 2, rank r starts out owning slot r)
+	 */
+	void populateByVector(const std::vector<T>& localValues)
+	{
+		if (!isPowerOfTwo(localValues.size()) || localValues.size() < 2)
+			throw std::runtime_error("Every rank needs a power of 2 number of leaves, at least 2");
+		unsigned long long count = localValues.size(), smallest, largest;
+		MPI_Allreduce(&count, &smallest, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, comm);
+		MPI_Allreduce(&count, &largest, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, comm);
+		if (smallest != largest)
+			throw std::runtime_error("Every rank needs the same number of leaves");
+		local = localValues;
+		depth = splitLevel + levelsForLeaves(local.size());
+		resetSlots();
+	}
+	/*
+	 * Creates a tree to a given number of layers with every leaf set to a value
+	 */
+	void populateToLevelValue(size_t level, const T& value)
+	{
+		if (level < splitLevel + 2)
+			throw std::runtime_error("Not enough layers for every rank to hold at least 2 leaves");
+		local.assign((size_t) 1 << (level - 1 - splitLevel), value);
+		depth = level;
+		resetSlots();
+	}
+	/*
+	 * Creates a tree to a given number of layers with default values
+	 */
+	void populateToLevel(size_t level)
+	{
+		populateToLevelValue(level, T());
+	}
+	/*
+	 * Swaps have the same meaning as for HipsTree
+	 */
+	void swapRandom()
+	{
+		// with a counter based generator the level gets a stream of its own so it does not depend on the ranks either
+		beginEvent(random, eventCount, levelStream);
+		swapLevel(random.getRandInt(depth - 2), false);
+	}
+	void swapRandomLevel(size_t level)
+	{
+		if (level > depth - 1)
+			throw std::runtime_error("Level too deep for swap");
+		swapLevel(level, false);
+	}
+	void swapRandomGrandchildrenLevel(size_t level)
+	{
+		if (level > depth - 2)
+			throw std::runtime_error("Level too deep for grandchild swap");
+		swapLevel(level, true);
+	}
+	/*
+	 * Chooses the mixing rule for the parcels that become siblings after a grandchild swap at level depth - 3
+	 */
+	void setMixingRule(MixingRule rule, double fraction=1.0)
+	{
+		mixer.setRule(rule, fraction);
+	}
+	void setMixingHook(std::function<void(T&, T&)> hook)
+	{
+		mixer.setHook(std::move(hook));
+	}
+	/*
+	 * Gathers every leaf in order on one rank (the other ranks get an empty vector), meant for checking small trees
+	 */
+	std::vector<T> inOrderValues(int root=0)
+	{
+		size_t bytes = local.size() * sizeof(T);
+		if (bytes > INT_MAX)
+			throw std::runtime_error("Too many leaves per rank to gather");
+		std::vector<T> byRank(rank == root ? local.size() * ranks : 0);
+		MPI_Gather(local.data(), (int) bytes, MPI_BYTE, byRank.data(), (int) bytes, MPI_BYTE, root, comm);
+		std::vector<T> ordered;
+		if (rank != root)
+			return ordered;
+		ordered.reserve(byRank.size());
+		for (int owner : slotOwner)
+			ordered.insert(ordered.end(), byRank.begin() + owner * local.size(),
+			               byRank.begin() + (owner + 1) * local.size());
+		return ordered;
+	}
+	/*
+	 * Returns the leaves this rank holds, in order
+	 */
+	const std::vector<T>& getLocalLeaves() const
+	{
+		return local;
+	}
+	/*
+	 * Returns the slot this rank's subtree is currently at (its leaves start at position slot * local leaf count)
+	 */
+	size_t getSlot() const
+	{
+		return std::find(slotOwner.begin(), slotOwner.end(), rank) - slotOwner.begin();
+	}
+	/*
+	 * Returns the rank that owns the subtree at a slot
+	 */
+	int getOwner(size_t slot) const
+	{
+		return slotOwner.at(slot);
+	}
+	/*
+	 * Returns the number of levels above the subtrees the ranks own (log2 of the number of ranks)
+	 */
+	size_t getSplitLevel() const
+	{
+		return splitLevel;
+	}
+	/*
+	 * Returns the current depth of the whole tree in layers
+	 */
+	size_t getDepth() const
+	{
+		return depth;
+	}
+	/*
+	 * Returns the number of swaps done so far, the event index the next swap gets
+	 */
+	uint64_t getEventCount() const
+	{
+		return eventCount;
+	}
+
+private:
+	struct Block
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	void swapLevel(size_t level, bool grandchild)
+	{
+		uint64_t index = eventCount++;
+		beginEvent(random, index, level);
+		size_t node = walkSlots(random, std::min(level, splitLevel));
+		if (level < splitLevel && !grandchild)
+		{
+			swapSlotBranches(node, level);
+			return;
+		}
+		if (level < splitLevel)
+		{
+			bool leftGrandchildLeft = random.getRandInt(1);
+			bool rightGrandchildLeft = random.getRandInt(1);
+			if (level + 1 < splitLevel)
+				swapSlotGrandchildren(node, level, leftGrandchildLeft, rightGrandchildLeft);
+			else
+				exchangeHalves(node, leftGrandchildLeft, rightGrandchildLeft);
+			return;
+		}
+		// below the split, node is the slot the swap landed in and only its owner has anything to do
+		if (slotOwner[node] != rank)
+			return;
+		if constexpr (isCounterBased<Rng>::value)
+		{
+			// replay the branches that chose the slot so the rest of the walk continues the event's stream
+			beginEvent(localRandom, index, level);
+			walkSlots(localRandom, splitLevel);
+		}
+		Block block = walkLocal(localRandom, level - splitLevel);
+		if (grandchild)
+			swapGrandchildrenAt(block, localRandom);
+		else
+			swapBlocks(block.offset, block.offset + block.size / 2, block.size / 2);
+	}
+	static void beginEvent(Rng& rng, uint64_t index, size_t level)
+	{
+		if constexpr (isCounterBased<Rng>::value)
+			rng.beginEvent(index, (uint32_t) level);
+	}
+	// walks the levels above the split and returns the index of the node reached, 1 is left like the tree's own walks
+	static size_t walkSlots(Rng& rng, size_t levels)
+	{
+		size_t node = 0;
+		for (size_t i = 0; i < levels; i++)
+			node = 2 * node + (rng.getRandInt(1) ? 0 : 1);
+		return node;
+	}
+	Block walkLocal(Rng& rng, size_t level)
+	{
+		Block block{0, local.size()};
+		for (size_t i = 0; i < level; i++)
+		{
+			block.size /= 2;
+			if (!rng.getRandInt(1))
+				block.offset += block.size;
+		}
+		return block;
+	}
+	void swapGrandchildrenAt(Block block, Rng& rng)
+	{
+		bool leftGrandchildLeft = rng.getRandInt(1);
+		bool rightGrandchildLeft = rng.getRandInt(1);
+		size_t quarter = block.size / 4;
+		size_t leftGrandchild = block.offset + (leftGrandchildLeft ? 0 : quarter);
+		size_t rightGrandchild = block.offset + 2 * quarter + (rightGrandchildLeft ? 0 : quarter);
+		swapBlocks(leftGrandchild, rightGrandchild, quarter);
+		if (quarter == 1 && mixer.isActive())
+			mixer.mixAdjacentPairs(&local[block.offset], 2);
+	}
+	void swapBlocks(size_t first, size_t second, size_t count)
+	{
+		std::swap_ranges(local.begin() + first, local.begin() + first + count, local.begin() + second);
+	}
+	// a node above the split owns a range of slots, its branches are the two halves of that range
+	void swapSlotBranches(size_t node, size_t level)
+	{
+		size_t size = (size_t) 1 << (splitLevel - level);
+		auto first = slotOwner.begin() + node * size;
+		std::swap_ranges(first, first + size / 2, first + size / 2);
+	}
+	void swapSlotGrandchildren(size_t node, size_t level, bool leftGrandchildLeft, bool rightGrandchildLeft)
+	{
+		size_t quarter = (size_t) 1 << (splitLevel - level - 2);
+		auto first = slotOwner.begin() + node * 4 * quarter;
+		auto leftGrandchild = first + (leftGrandchildLeft ? 0 : quarter);
+		auto rightGrandchild = first + 2 * quarter + (rightGrandchildLeft ? 0 : quarter);
+		std::swap_ranges(leftGrandchild, leftGrandchild + quarter, rightGrandchild);
+	}
+	// the grandchildren of a node at split - 1 are halves of two ranks' leaves, the two owners trade them
+	void exchangeHalves(size_t node, bool leftGrandchildLeft, bool rightGrandchildLeft)
+	{
+		int leftOwner = slotOwner[2 * node];
+		int rightOwner = slotOwner[2 * node + 1];
+		if (rank != leftOwner && rank != rightOwner)
+			return;
+		size_t half = local.size() / 2;
+		bool left = rank == leftOwner;
+		int partner = left ? rightOwner : leftOwner;
+		bool firstHalf = left ? leftGrandchildLeft : rightGrandchildLeft;
+		char* bytes = reinterpret_cast<char*>(local.data() + (firstHalf ? 0 : half));
+		for (size_t remaining = half * sizeof(T); remaining > 0;)
+		{
+			int count = (int) std::min(remaining, exchangeChunk);
+			MPI_Sendrecv_replace(bytes, count, MPI_BYTE, partner, 0, partner, 0, comm, MPI_STATUS_IGNORE);
+			bytes += count;
+			remaining -= count;
+		}
+		// with 2 leaves per rank each rank now holds one of the two new pairs of parcels
+		if (half == 1)
+			mixer.mixAdjacentPairs(local.data(), 1);
+	}
+	void resetSlots()
+	{
+		slotOwner.resize(ranks);
+		for (int i = 0; i < ranks; i++)
+			slotOwner[i] = i;
+	}
+	static int rankOf(MPI_Comm comm)
+	{
+		int r;
+		MPI_Comm_rank(comm, &r);
+		return r;
+	}
+	static size_t levelsForLeaves(size_t count)
+	{
+		size_t levels = 1;
+		while (((size_t) 1 << (levels - 1)) < count)
+			levels++;
+		return levels;
+	}
+	static bool isPowerOfTwo(size_t n)
+	{
+		return n > 0 && (n & (n - 1)) == 0;
+	}
+
+	// MPI counts are ints, big exchanges go in pieces of this many bytes
+	static constexpr size_t exchangeChunk = (size_t) 1 << 30;
+	static constexpr uint32_t levelStream = UINT32_MAX;
+
+	MPI_Comm comm;
+	int rank = 0;
+	int ranks = 1;
+	size_t splitLevel = 0;
+	size_t depth = 0;
+	// slotOwner[s] is the rank whose subtree is at slot s, the same on every rank
+	std::vector<int> slotOwner;
+	std::vector<T> local;
+	MixingKernel<T> mixer;
+	// the same on every rank
+	Rng random;
+	// this rank's own branches below the split
+	Rng localRandom;
+	uint64_t eventCount = 0;
+};
+
+#endif //DOMPI
+
+#endif //DISTRIBUTEDHIPSTREE_H
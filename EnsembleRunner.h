@@ -0,0 +1,178 @@
+#ifndef ENSEMBLERUNNER_H
+#define ENSEMBLERUNNER_H
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/*
+ * Moments of one statistic over the realizations of an ensemble
+ */
+struct EnsembleMoments
+{
+	size_t count = 0;
+	double mean = 0;
+	// sample variance (divided by count - 1), 0 for a single realization
+	double variance = 0;
+	double min = std::numeric_limits<double>::infinity();
+	double max = -std::numeric_limits<double>::infinity();
+
+	/*
+	 * Adds one realization's value (Welford's update so large ensembles do not lose precision)
+	 */
+	void add(double value)
+	{
+		count++;
+		double delta = value - mean;
+		mean += delta / (double) count;
+		m2 += delta * (value - mean);
+		variance = count > 1 ? m2 / (double) (count - 1) : 0;
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+	/*
+	 * Returns the standard error of the mean
+	 */
+	double standardError() const
+	{
+		return count > 0 ? std::sqrt(variance / (double) count) : 0;
+	}
+
+private:
+	double m2 = 0;
+};
+
+/*
+ * Ensemble runner class
+ *
+ * Owns many independent realizations of a tree in one process and steps them concurrently on a thread pool. Tree i is
+ * seeded with baseSeed + i, so every realization has its own generator and is exactly the tree a separate run with
+ * that seed would give, whatever the number of threads. The pool hands the next realization to whichever thread is
+ * free, so realizations that take longer do not hold up the others.
+ *
+ * Between steps are the sync points: gather collects one statistic per realization and reduce folds it into moments
+ * over the ensemble. Both visit the realizations in the same order every time, so the reductions do not depend on the
+ * thread count either.
+ */
+template <typename Tree>
+class EnsembleRunner
+{
+public:
+	using Factory = std::function<std::unique_ptr<Tree>(int seed, size_t realization)>;
+	using Step = std::function<void(Tree& tree, size_t realization)>;
+	using Measure = std::function<double(Tree& tree, size_t realization)>;
+
+	/*
+	 * Creates realizations blank trees seeded with baseSeed, baseSeed + 1 and so on
+	 */
+	EnsembleRunner(size_t realizations, int baseSeed, size_t threads=std::thread::hardware_concurrency())
+		: EnsembleRunner(realizations, baseSeed, [](int seed, size_t) { return std::unique_ptr<Tree>(new Tree(seed)); },
+		                 threads)
+	{
+	}
+	/*
+	 * Same as above with a function that makes each tree (for trees that need more than a seed to construct)
+	 */
+	EnsembleRunner(size_t realizations, int baseSeed, const Factory& make,
+	               size_t threads=std::thread::hardware_concurrency())
+		: baseSeed(baseSeed), pool(threads)
+	{
+		if (realizations == 0)
+			throw std::runtime_error("An ensemble needs at least one realization");
+		trees.reserve(realizations);
+		for (size_t i = 0; i < realizations; i++)
+			trees.push_back(make(baseSeed + (int) i, i));
+	}
+	/*
+	 * Populates every tree with a copy of the same leaves, in parallel so no thread builds every tree's memory
+	 */
+	template <typename T>
+	void populateByVector(const std::vector<T>& values)
+	{
+		step([&values](Tree& tree, size_t) { tree.populateByVector(values); });
+	}
+	/*
+	 * Runs advance on every realization and waits for all of them
+	 */
+	void step(const Step& advance)
+	{
+		pool.parallelFor(trees.size(), [&](size_t i) { advance(*trees[i], i); });
+	}
+	/*
+	 * Returns measure of every realization, in realization order
+	 */
+	template <typename R>
+	std::vector<R> gather(const std::function<R(Tree& tree, size_t realization)>& measure)
+	{
+		std::vector<R> results(trees.size());
+		pool.parallelFor(trees.size(), [&](size_t i) { results[i] = measure(*trees[i], i); });
+		return results;
+	}
+	/*
+	 * Returns the moments of measure over the realizations
+	 */
+	EnsembleMoments reduce(const Measure& measure)
+	{
+		EnsembleMoments moments;
+		for (double value : gather<double>(measure))
+			moments.add(value);
+		return moments;
+	}
+	/*
+	 * Steps every realization syncPoints times and reduces measure after each step
+	 */
+	std::vector<EnsembleMoments> run(size_t syncPoints, const Step& advance, const Measure& measure)
+	{
+		std::vector<EnsembleMoments> series;
+		series.reserve(syncPoints);
+		for (size_t s = 0; s < syncPoints; s++)
+		{
+			step(advance);
+			series.push_back(reduce(measure));
+		}
+		return series;
+	}
+	/*
+	 * Returns one realization
+	 */
+	Tree& getTree(size_t realization)
+	{
+		if (realization >= trees.size())
+			throw std::out_of_range("Realization index out of range");
+		return *trees[realization];
+	}
+	/*
+	 * Returns the seed a realization was made with
+	 */
+	int getSeed(size_t realization) const
+	{
+		return baseSeed + (int) realization;
+	}
+	/*
+	 * Returns the number of realizations
+	 */
+	size_t size() const
+	{
+		return trees.size();
+	}
+	/*
+	 * Returns the number of threads realizations run on
+	 */
+	size_t getThreads() const
+	{
+		return pool.size();
+	}
+
+private:
+	int baseSeed;
+	std::vector<std::unique_ptr<Tree>> trees;
+	ThreadPool pool;
+};
+
+#endif //ENSEMBLERUNNER_H
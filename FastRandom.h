@@ -0,0 +1,355 @@
+#ifndef FASTRANDOM_H
+#define FASTRANDOM_H
+
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Random generator policies
+ *
+ * The trees draw their branches from a generator policy given as a template parameter, randomGenerator by default so
+ * seeded runs match BYUIgnite:SEC. A policy needs:
+ *   a constructor from an int seed
+ *   int getRandInt(unsigned n)       uniform integer in [0, n]
+ *   double getRand()                 uniform real in [0, 1]
+ *   static const int stateSize       number of 32 bit words in a saved state
+ *   void save(uint32_t*) const and void load(const uint32_t*)
+ *
+ * These are much cheaper than the Mersenne Twister but give different sequences for the same seed.
+ */
+
+/*
+ * Uniform integer in [0, n] from 32 random bits using Lemire's multiply and shift with rejection
+ */
+template <typename Next32>
+inline uint32_t boundedRandom(uint32_t n, Next32 next32)
+{
+	if (n == UINT32_MAX)
+		return next32();
+	uint32_t range = n + 1;
+	uint64_t product = (uint64_t) next32() * range;
+	uint32_t low = (uint32_t) product;
+	if (low < range)
+	{
+		uint32_t threshold = (0u - range) % range;
+		while (low < threshold)
+		{
+			product = (uint64_t) next32() * range;
+			low = (uint32_t) product;
+		}
+	}
+	return (uint32_t) (product >> 32);
+}
+
+/*
+ * SplitMix64 step, used to spread a small seed over a larger state
+ */
+inline uint64_t splitMix64(uint64_t& x)
+{
+	uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+/*
+ * xoshiro256** by Blackman and Vigna, 256 bits of state and 64 bits per step
+ */
+class Xoshiro256ss
+{
+public:
+	static const int stateSize = 8;
+
+	explicit Xoshiro256ss(int seed=0)
+	{
+		uint64_t x = (uint64_t) (int64_t) seed;
+		for (auto& word : s)
+			word = splitMix64(x);
+	}
+	uint64_t next64()
+	{
+		uint64_t result = rotl(s[1] * 5, 7) * 9;
+		uint64_t t = s[1] << 17;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 45);
+		return result;
+	}
+	int getRandInt(unsigned n)
+	{
+		return (int) boundedRandom(n, [this]() { return (uint32_t) (next64() >> 32); });
+	}
+	double getRand()
+	{
+		return (double) (next64() >> 11) * (1.0 / 9007199254740991.0);
+	}
+	void save(uint32_t* state) const
+	{
+		for (int i = 0; i < 4; i++)
+			state[2 * i] = (uint32_t) s[i], state[2 * i + 1] = (uint32_t) (s[i] >> 32);
+	}
+	void load(const uint32_t* state)
+	{
+		for (int i = 0; i < 4; i++)
+			s[i] = state[2 * i] | ((uint64_t) state[2 * i + 1] << 32);
+	}
+
+private:
+	static uint64_t rotl(uint64_t x, int k)
+	{
+		return (x << k) | (x >> (64 - k));
+	}
+
+	uint64_t s[4];
+};
+
+/*
+ * PCG32 (XSH RR 64/32) by O'Neill, 64 bits of state and 32 bits per step
+ */
+class Pcg32
+{
+public:
+	static const int stateSize = 4;
+
+	explicit Pcg32(int seed=0)
+	{
+		uint64_t x = (uint64_t) (int64_t) seed;
+		increment = splitMix64(x) | 1;
+		state = 0;
+		next32();
+		state += splitMix64(x);
+		next32();
+	}
+	uint32_t next32()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ULL + increment;
+		uint32_t shifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+		uint32_t rotation = (uint32_t) (old >> 59);
+		return (shifted >> rotation) | (shifted << ((0u - rotation) & 31));
+	}
+	uint64_t next64()
+	{
+		uint64_t high = next32();
+		return (high << 32) | next32();
+	}
+	int getRandInt(unsigned n)
+	{
+		return (int) boundedRandom(n, [this]() { return next32(); });
+	}
+	double getRand()
+	{
+		return (double) (next64() >> 11) * (1.0 / 9007199254740991.0);
+	}
+	void save(uint32_t* words) const
+	{
+		words[0] = (uint32_t) state, words[1] = (uint32_t) (state >> 32);
+		words[2] = (uint32_t) increment, words[3] = (uint32_t) (increment >> 32);
+	}
+	void load(const uint32_t* words)
+	{
+		state = words[0] | ((uint64_t) words[1] << 32);
+		increment = words[2] | ((uint64_t) words[3] << 32);
+	}
+
+private:
+	uint64_t state;
+	uint64_t increment;
+};
+
+/*
+ * Bit buffered adapter
+ *
+ * Almost every draw a tree makes is getRandInt(1), a single branch bit. This hands those out one bit at a time from a
+ * 64 bit word of the wrapped generator, and passes every other draw straight through.
+ */
+template <typename Base>
+class BitBufferedRng
+{
+public:
+	static const int stateSize = Base::stateSize + 3;
+
+	explicit BitBufferedRng(int seed=0) : base(seed) {}
+
+	int getRandInt(unsigned n)
+	{
+		if (n != 1)
+			return base.getRandInt(n);
+		if (bitsLeft == 0)
+		{
+			bits = nextWord(base);
+			bitsLeft = 64;
+		}
+		int bit = (int) (bits & 1);
+		bits >>= 1;
+		bitsLeft--;
+		return bit;
+	}
+	double getRand()
+	{
+		return base.getRand();
+	}
+	void save(uint32_t* state) const
+	{
+		base.save(state);
+		state[Base::stateSize] = (uint32_t) bits;
+		state[Base::stateSize + 1] = (uint32_t) (bits >> 32);
+		state[Base::stateSize + 2] = bitsLeft;
+	}
+	void load(const uint32_t* state)
+	{
+		base.load(state);
+		bits = state[Base::stateSize] | ((uint64_t) state[Base::stateSize + 1] << 32);
+		bitsLeft = state[Base::stateSize + 2];
+	}
+
+private:
+	// generators with a native 64 bit step use it, anything else gives two 32 bit draws
+	template <typename G>
+	static auto nextWord(G& generator) -> decltype(generator.next64())
+	{
+		return generator.next64();
+	}
+	template <typename G, typename... Ignored>
+	static uint64_t nextWord(G& generator, Ignored...)
+	{
+		uint64_t high = (uint32_t) generator.getRandInt(UINT32_MAX);
+		return (high << 32) | (uint32_t) generator.getRandInt(UINT32_MAX);
+	}
+
+	Base base;
+	uint64_t bits = 0;
+	uint32_t bitsLeft = 0;
+};
+
+/*
+ * Philox4x32-10 by Salmon et al., a counter based generator
+ *
+ * Every block of 128 bits is a keyed hash of a 128 bit counter, so any point of the sequence can be reached without
+ * drawing what comes before it. beginEvent(index, level) jumps to the stream that belongs to one swap event, and what
+ * that event draws then only depends on the seed, the event index and the level, not on what other events were drawn
+ * before it or on which thread. Without beginEvent it is an ordinary sequential generator (event 0, level 0).
+ *
+ * Branch bits are taken one at a time from 32 bit words, so a whole walk usually costs a single block.
+ */
+class PhiloxRandom
+{
+public:
+	static const int stateSize = 13;
+
+	explicit PhiloxRandom(int seed=0) : key{(uint32_t) seed, 0x5ec0ffee}
+	{
+		beginEvent(0, 0);
+	}
+	/*
+	 * Starts the stream of draws for swap event index at a level
+	 */
+	void beginEvent(uint64_t index, uint32_t level)
+	{
+		counter[0] = 0;
+		counter[1] = level;
+		counter[2] = (uint32_t) index;
+		counter[3] = (uint32_t) (index >> 32);
+		word = 4;
+		bitsLeft = 0;
+	}
+	uint32_t next32()
+	{
+		if (word == 4)
+			nextBlock();
+		return block[word++];
+	}
+	uint64_t next64()
+	{
+		uint64_t high = next32();
+		return (high << 32) | next32();
+	}
+	int getRandInt(unsigned n)
+	{
+		if (n == 1)
+		{
+			if (bitsLeft == 0)
+			{
+				bits = next32();
+				bitsLeft = 32;
+			}
+			int bit = (int) (bits & 1);
+			bits >>= 1;
+			bitsLeft--;
+			return bit;
+		}
+		return (int) boundedRandom(n, [this]() { return next32(); });
+	}
+	double getRand()
+	{
+		return (double) (next64() >> 11) * (1.0 / 9007199254740991.0);
+	}
+	void save(uint32_t* state) const
+	{
+		state[0] = key[0], state[1] = key[1];
+		for (int i = 0; i < 4; i++)
+			state[2 + i] = counter[i], state[6 + i] = block[i];
+		state[10] = word, state[11] = bits, state[12] = bitsLeft;
+	}
+	void load(const uint32_t* state)
+	{
+		key[0] = state[0], key[1] = state[1];
+		for (int i = 0; i < 4; i++)
+			counter[i] = state[2 + i], block[i] = state[6 + i];
+		word = state[10], bits = state[11], bitsLeft = state[12];
+	}
+	/*
+	 * One Philox4x32-10 block for a counter and key
+	 */
+	static void philox(const uint32_t in[4], const uint32_t inKey[2], uint32_t out[4])
+	{
+		uint32_t c0 = in[0], c1 = in[1], c2 = in[2], c3 = in[3];
+		uint32_t k0 = inKey[0], k1 = inKey[1];
+		for (int round = 0; round < 10; round++)
+		{
+			uint64_t product0 = (uint64_t) 0xD2511F53 * c0;
+			uint64_t product1 = (uint64_t) 0xCD9E8D57 * c2;
+			uint32_t next0 = (uint32_t) (product1 >> 32) ^ c1 ^ k0;
+			uint32_t next2 = (uint32_t) (product0 >> 32) ^ c3 ^ k1;
+			c1 = (uint32_t) product1;
+			c3 = (uint32_t) product0;
+			c0 = next0;
+			c2 = next2;
+			k0 += 0x9E3779B9;
+			k1 += 0xBB67AE85;
+		}
+		out[0] = c0, out[1] = c1, out[2] = c2, out[3] = c3;
+	}
+
+private:
+	void nextBlock()
+	{
+		philox(counter, key, block);
+		// carry through the whole counter so a long sequential run never repeats a block
+		for (int i = 0; i < 4; i++)
+			if (++counter[i] != 0)
+				break;
+		word = 0;
+	}
+
+	uint32_t key[2];
+	uint32_t counter[4];
+	uint32_t block[4] = {};
+	uint32_t word = 4;
+	uint32_t bits = 0;
+	uint32_t bitsLeft = 0;
+};
+
+/*
+ * Whether a generator can jump to the stream of a swap event (has beginEvent)
+ */
+template <typename Rng, typename=void>
+struct isCounterBased : std::false_type {};
+template <typename Rng>
+struct isCounterBased<Rng, decltype(std::declval<Rng&>().beginEvent(0, 0))> : std::true_type {};
+
+#endif //FASTRANDOM_H
@@ -0,0 +1,581 @@
+#ifndef FLATHIPSTREE_H
+#define FLATHIPSTREE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <ctime>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include "LeafHandle.h"
+#include "Mixing.h"
+#include "ThreadPool.h"
+#include "randomGenerator.h"
+
+/*
+ * Flat tree class
+ *
+ * Every tree built by HipsTree is a perfect binary tree, so the internal nodes carry no information beyond the order
+ * of the leaves. This tree only stores that order as one contiguous array of leaves. A node at level L owns a block of
+ * 2^(depth - 1 - L) consecutive leaves, swapping its branches swaps the two halves of that block and a grandchild swap
+ * swaps two quarter blocks. The random branch choices are drawn in the same order as HipsTree so both trees produce
+ * the same leaf order for the same seed and generator policy.
+ *
+ * With lazy swaps turned on each internal node also gets a flipped bit. A branch swap only toggles that bit after the
+ * walk and a grandchild swap follows the bits to the two physical subtrees it exchanges. The leaves are put back in
+ * order the next time they are read through inOrderValues, inOrderLeaves, getIterator or toString.
+ */
+template <typename T, typename Rng=randomGenerator>
+class FlatHipsTree
+{
+public:
+	/*
+	 * Gets a shared pointer to a blank tree
+	 */
+	static std::shared_ptr<FlatHipsTree<T, Rng>> getTree(int randSeed=time(nullptr))
+	{
+		return std::make_shared<FlatHipsTree<T, Rng>>(randSeed);
+	}
+	/*
+	 * Gets a shared pointer to a tree populated with a vector of leaves
+	 */
+	static std::shared_ptr<FlatHipsTree<T, Rng>> getTree(const std::vector<T>& values, int randSeed=time(nullptr))
+	{
+		return std::make_shared<FlatHipsTree<T, Rng>>(values, randSeed);
+	}
+	static std::shared_ptr<FlatHipsTree<T, Rng>> getTree(std::vector<T>&& values, int randSeed=time(nullptr))
+	{
+		return std::make_shared<FlatHipsTree<T, Rng>>(std::move(values), randSeed);
+	}
+	/*
+	 * Default constructor
+	 */
+	explicit FlatHipsTree(int randSeed) : random(randSeed)
+	{
+	}
+	/*
+	 * Constructor with values
+	 */
+	FlatHipsTree(const std::vector<T>& values, int randSeed) : random(randSeed)
+	{
+		populateByVector(values);
+	}
+	FlatHipsTree(std::vector<T>&& values, int randSeed) : random(randSeed)
+	{
+		populateByVector(std::move(values));
+	}
+	/*
+	 * Populates the tree with a vector of leaves - the vector should be a power of 2
+	 */
+	void populateByVector(const std::vector<T>& values)
+	{
+		populateByRange(values.begin(), values.end());
+	}
+	/*
+	 * Same as above but takes over the vector's storage, nothing is copied (values is left empty)
+	 */
+	void populateByVector(std::vector<T>&& values)
+	{
+		if (!isPowerOfTwo(values.size()))
+			throw std::runtime_error("Vector of values is not a power of 2 in size");
+		leaves = std::move(values);
+		values.clear();
+		depth = levelsForLeaves(leaves.size());
+		clearFlips();
+	}
+	/*
+	 * Populates the tree with the values in [first, last) (a range of move iterators moves them in)
+	 */
+	template <typename It>
+	void populateByRange(It first, It last)
+	{
+		if (!isPowerOfTwo((size_t) std::distance(first, last)))
+			throw std::runtime_error("Vector of values is not a power of 2 in size");
+		leaves.assign(first, last);
+		depth = levelsForLeaves(leaves.size());
+		clearFlips();
+	}
+	/*
+	 * Populates the tree to a given number of layers filling the leaves with a given value
+	 */
+	void populateToLevelValue(size_t level, const T& value)
+	{
+		leaves.assign(leavesForLevels(level), value);
+		depth = level;
+		clearFlips();
+	}
+	/*
+	 * Creates a tree with default constructed values to a given number of layers
+	 */
+	void populateToLevel(size_t level)
+	{
+		leaves.assign(leavesForLevels(level), T());
+		depth = level;
+		clearFlips();
+	}
+	/*
+	 * Removes all leaves and makes tree have size 0
+	 */
+	void resetTree()
+	{
+		leaves.clear();
+		leaves.shrink_to_fit();
+		depth = 0;
+		clearFlips();
+	}
+	/*
+	 * Turns lazy swaps on or off (pending swaps are applied to the leaves first, so none are lost)
+	 */
+	void setLazySwaps(bool lazy)
+	{
+		materialize();
+		lazySwaps = lazy;
+		clearFlips();
+	}
+	/*
+	 * Returns whether swaps are recorded as flipped bits instead of moving leaves
+	 */
+	bool getLazySwaps()
+	{
+		return lazySwaps;
+	}
+	/*
+	 * Applies the pending flipped bits so the leaf array is in order (reading the leaves does this automatically)
+	 */
+	void materialize()
+	{
+		if (!pendingFlips)
+			return;
+		std::vector<T> ordered(leaves.size());
+		resolveHelper(1, 0, ordered.data(), [this](T& to, size_t leaf) { to = std::move(leaves[leaf]); });
+		leaves.swap(ordered);
+		std::fill(flipped.begin(), flipped.end(), 0);
+		pendingFlips = false;
+	}
+	/*
+	 * Gets a vector of copies of the values of the leaves
+	 */
+	std::vector<T> inOrderValues()
+	{
+		materialize();
+		return leaves;
+	}
+	/*
+	 * Copies the values of the leaves in order into out, which needs room for every leaf. With a pool the copy is split
+	 * across its threads. Pending lazy swaps are resolved while copying and are left pending in the tree.
+	 */
+	void snapshot(T* out, ThreadPool* pool=nullptr)
+	{
+		if (depth == 0)
+			return;
+		size_t splitLevel = 0;
+		if (pool != nullptr)
+			while (((size_t) 1 << splitLevel) < 4 * pool->size() && splitLevel + 1 < depth)
+				splitLevel++;
+		// physical node of each logical node at the split level
+		std::vector<size_t> nodes{1};
+		for (size_t level = 0; level < splitLevel; level++)
+		{
+			std::vector<size_t> children;
+			children.reserve(2 * nodes.size());
+			for (auto node : nodes)
+			{
+				children.push_back(pendingFlips ? physicalChild(node, 0) : 2 * node);
+				children.push_back(pendingFlips ? physicalChild(node, 1) : 2 * node + 1);
+			}
+			nodes.swap(children);
+		}
+		size_t count = leaves.size() >> splitLevel;
+		auto copySubtree = [&](size_t i) {
+			if (pendingFlips)
+				resolveHelper(nodes[i], splitLevel, out + i * count, [this](T& to, size_t leaf) { to = leaves[leaf]; });
+			else
+				std::copy(leaves.begin() + (nodes[i] - nodes.size()) * count,
+				          leaves.begin() + (nodes[i] - nodes.size() + 1) * count, out + i * count);
+		};
+		if (pool != nullptr)
+			pool->parallelFor(nodes.size(), copySubtree);
+		else
+			copySubtree(0);
+	}
+	/*
+	 * Same as above into a vector that is resized to the number of leaves (reusing a vector avoids allocating)
+	 */
+	void snapshot(std::vector<T>& buffer, ThreadPool* pool=nullptr)
+	{
+		buffer.resize(leaves.size());
+		snapshot(buffer.data(), pool);
+	}
+	/*
+	 * Moves the leaves out in order without copying them and leaves the tree empty
+	 */
+	std::vector<T> extractValues()
+	{
+		materialize();
+		std::vector<T> values = std::move(leaves);
+		resetTree();
+		return values;
+	}
+	/*
+	 * Gets a vector of handles to the leaves (used like HipsTree's leaf nodes)
+	 */
+	std::vector<LeafHandle<T>> inOrderLeaves()
+	{
+		materialize();
+		std::vector<LeafHandle<T>> handles;
+		handles.reserve(leaves.size());
+		for (auto& leaf : leaves)
+			handles.emplace_back(&leaf);
+		return handles;
+	}
+	/*
+	 * Chooses a random level and then random branches until it reaches that level, eventually switching the left and
+	 * right children of a node
+	 */
+	void swapRandom()
+	{
+		size_t level = random.getRandInt(depth - 2);
+		if (lazySwaps)
+			flipAt(walkToNode(level), level);
+		else
+			swapBranchesAt(walkToLevel(level));
+	}
+	/*
+	 * Uses random branches to reach a specified level then swaps those branches
+	 */
+	void swapRandomLevel(size_t level)
+	{
+		if (level > depth - 1)
+			throw std::runtime_error("Level too deep for swap");
+		if (lazySwaps)
+			flipAt(walkToNode(level), level);
+		else
+			swapBranchesAt(walkToLevel(level));
+	}
+	/*
+	 * Swap grandchildren as used by hips code
+	 */
+	void swapRandomGrandchildrenLevel(size_t level)
+	{
+		if (level > depth - 2)
+			throw std::runtime_error("Level too deep for grandchild swap");
+		if (lazySwaps)
+			swapGrandchildrenNode(walkToNode(level), level);
+		else
+			swapGrandchildrenAt(walkToLevel(level));
+	}
+	/*
+	 * Does swap event number index with its branches drawn from the generator's stream for that event, so the result
+	 * does not depend on any other event (needs a counter based generator like PhiloxRandom)
+	 */
+	void swapEvent(uint64_t index, size_t level, bool grandchild)
+	{
+		random.beginEvent(index, (uint32_t) level);
+		if (grandchild)
+			swapRandomGrandchildrenLevel(level);
+		else
+			swapRandomLevel(level);
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a built in rule
+	 */
+	void setMixingRule(MixingRule rule, double fraction=1.0)
+	{
+		mixer.setRule(rule, fraction);
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a function
+	 */
+	void setMixingHook(std::function<void(T&, T&)> hook)
+	{
+		mixer.setHook(std::move(hook));
+	}
+	/*
+	 * Returns the generator the tree draws its branches from
+	 */
+	Rng& getRandomGenerator()
+	{
+		return random;
+	}
+	/*
+	 * Returns the current depth of the tree in layers
+	 */
+	size_t getDepth()
+	{
+		return depth;
+	}
+
+	/*
+	 * Tree iterator class allows traversing the leaves of the tree
+	 */
+	class TreeIterator
+	{
+	public:
+		TreeIterator(T* first, T* last) : current(first), end(last) {}
+
+		LeafHandle<T> next()
+		{
+			if (current == end)
+				return nullptr;
+			return LeafHandle<T>(current++);
+		}
+
+		bool hasNext()
+		{
+			return current != end;
+		}
+
+	private:
+		T* current;
+		T* end;
+	};
+
+	/*
+	 * Returns the leaf at a position
+	 */
+	T& leafAt(size_t index)
+	{
+		materialize();
+		return leaves.at(index);
+	}
+
+	/*
+	 * Leaf span class is a pointer and a count over leaves that are next to each other
+	 */
+	class LeafSpan
+	{
+	public:
+		LeafSpan(T* first, size_t count) : first(first), count(count) {}
+
+		T* begin() const
+		{
+			return first;
+		}
+		T* end() const
+		{
+			return first + count;
+		}
+		T* data() const
+		{
+			return first;
+		}
+		size_t size() const
+		{
+			return count;
+		}
+		T& operator[](size_t index) const
+		{
+			return first[index];
+		}
+
+	private:
+		T* first;
+		size_t count;
+	};
+
+	/*
+	 * Returns the leaves under node index (counted from the left) at a level without copying them, they are always one
+	 * block of the array. Swaps inside the subtree show through the span, with lazy swaps take the span again after
+	 * swapping because the leaves are only put in order when it is taken.
+	 */
+	LeafSpan subtree(size_t level, size_t index)
+	{
+		if (depth == 0 || level > depth - 1)
+			throw std::runtime_error("Level too deep for this tree");
+		if (index >= ((size_t) 1 << level))
+			throw std::out_of_range("Subtree index out of range");
+		materialize();
+		size_t count = leaves.size() >> level;
+		return LeafSpan(leaves.data() + index * count, count);
+	}
+
+	using iterator = typename std::vector<T>::iterator;
+	using const_iterator = typename std::vector<T>::const_iterator;
+
+	/*
+	 * Iterators over the values of the leaves in order (the leaves are put in order first with lazy swaps)
+	 */
+	iterator begin()
+	{
+		materialize();
+		return leaves.begin();
+	}
+	iterator end()
+	{
+		materialize();
+		return leaves.end();
+	}
+	const_iterator cbegin()
+	{
+		materialize();
+		return leaves.cbegin();
+	}
+	const_iterator cend()
+	{
+		materialize();
+		return leaves.cend();
+	}
+
+	/*
+	 * Returns an iterator that will start at the first leaf
+	 */
+	TreeIterator getIterator()
+	{
+		materialize();
+		return TreeIterator(leaves.data(), leaves.data() + leaves.size());
+	}
+	/*
+	 * Returns a string of the values of the leaves in order
+	 */
+	std::string toString(const std::string& sep=", ")
+	{
+		materialize();
+		std::stringstream ss;
+		std::string se;
+		for (const auto& leaf : leaves)
+		{
+			ss << se << leaf;
+			se = sep;
+		}
+		return ss.str();
+	}
+
+private:
+	/*
+	 * Various helper functions and members
+	 */
+
+	// first leaf and number of leaves under a node
+	struct Block
+	{
+		size_t offset;
+		size_t size;
+	};
+
+	Block walkToLevel(size_t level)
+	{
+		Block block{0, leaves.size()};
+		for (size_t i = 0; i < level; i++)
+		{
+			block.size /= 2;
+			if (!random.getRandInt(1))
+				block.offset += block.size;
+		}
+		return block;
+	}
+	void swapBranchesAt(Block block)
+	{
+		size_t half = block.size / 2;
+		swapBlocks(block.offset, block.offset + half, half);
+	}
+	void swapGrandchildrenAt(Block block)
+	{
+		bool leftGrandchildLeft = random.getRandInt(1);
+		bool rightGrandchildLeft = random.getRandInt(1);
+		size_t quarter = block.size / 4;
+		size_t leftGrandchild = block.offset + (leftGrandchildLeft ? 0 : quarter);
+		size_t rightGrandchild = block.offset + 2 * quarter + (rightGrandchildLeft ? 0 : quarter);
+		swapBlocks(leftGrandchild, rightGrandchild, quarter);
+		// the four leaves under a node at depth - 3 are the two new pairs of parcels
+		if (quarter == 1 && mixer.isActive())
+			mixer.mixAdjacentPairs(&leaves[block.offset], 2);
+	}
+
+	/*
+	 * Lazy swap helpers, nodes are numbered like a heap with the root at 1 and the children of n at 2n and 2n + 1
+	 */
+
+	size_t walkToNode(size_t level)
+	{
+		size_t node = 1;
+		for (size_t i = 0; i < level; i++)
+			node = physicalChild(node, random.getRandInt(1) ? 0 : 1);
+		return node;
+	}
+	size_t physicalChild(size_t node, size_t side) const
+	{
+		return 2 * node + (side ^ flipped[node]);
+	}
+	void flipAt(size_t node, size_t level)
+	{
+		if (level + 1 < depth)
+		{
+			flipped[node] ^= 1;
+			pendingFlips = true;
+		}
+	}
+	void swapGrandchildrenNode(size_t node, size_t level)
+	{
+		bool leftGrandchildLeft = random.getRandInt(1);
+		bool rightGrandchildLeft = random.getRandInt(1);
+		if (level + 3 > depth)
+			return;
+		size_t leftGrandchild = physicalChild(physicalChild(node, 0), leftGrandchildLeft ? 0 : 1);
+		size_t rightGrandchild = physicalChild(physicalChild(node, 1), rightGrandchildLeft ? 0 : 1);
+		// the subtrees take their own pending flips with them
+		size_t grandchildLevel = level + 2;
+		if (pendingFlips)
+		{
+			for (size_t k = 0; grandchildLevel + k + 1 < depth; k++)
+				std::swap_ranges(flipped.begin() + (leftGrandchild << k), flipped.begin() + ((leftGrandchild + 1) << k),
+				                 flipped.begin() + (rightGrandchild << k));
+		}
+		size_t count = leaves.size() >> grandchildLevel;
+		swapBlocks((leftGrandchild - ((size_t) 1 << grandchildLevel)) * count,
+		           (rightGrandchild - ((size_t) 1 << grandchildLevel)) * count, count);
+		// flips only change the order within each pair so the pairs are still adjacent
+		if (count == 1 && mixer.isActive())
+			mixer.mixAdjacentPairs(&leaves[(node - ((size_t) 1 << level)) * 4], 2);
+	}
+	// put(to, leaf) stores the leaf with index leaf into to, by copying it or moving it
+	template <typename Put>
+	void resolveHelper(size_t node, size_t level, T* out, const Put& put) const
+	{
+		if (level + 1 == depth)
+		{
+			put(*out, node - leaves.size());
+			return;
+		}
+		size_t half = leaves.size() >> (level + 1);
+		resolveHelper(physicalChild(node, 0), level + 1, out, put);
+		resolveHelper(physicalChild(node, 1), level + 1, out + half, put);
+	}
+	void clearFlips()
+	{
+		flipped.assign(lazySwaps ? leaves.size() : 0, 0);
+		pendingFlips = false;
+	}
+	void swapBlocks(size_t first, size_t second, size_t count)
+	{
+		std::swap_ranges(leaves.begin() + first, leaves.begin() + first + count, leaves.begin() + second);
+	}
+	static size_t leavesForLevels(size_t level)
+	{
+		return level > 0 ? (size_t) 1 << (level - 1) : 0;
+	}
+	static size_t levelsForLeaves(size_t count)
+	{
+		size_t level = 1;
+		while (((size_t) 1 << (level - 1)) < count)
+			level++;
+		return level;
+	}
+	static bool isPowerOfTwo(size_t n)
+	{
+		return n != 0 && (n & (n - 1)) == 0;
+	}
+
+	std::vector<T> leaves;
+	// flipped bit of internal node n (index 0 is unused), only allocated with lazy swaps
+	std::vector<uint8_t> flipped;
+	MixingKernel<T> mixer;
+	bool lazySwaps = false;
+	bool pendingFlips = false;
+	size_t depth = 0;
+	Rng random;
+};
+
+#endif //FLATHIPSTREE_H
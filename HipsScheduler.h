@@ -0,0 +1,162 @@
+#ifndef HIPSSCHEDULER_H
+#define HIPSSCHEDULER_H
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <vector>
+
+#include "HipsTree.h"
+
+/*
+ * Scheduler class
+ *
+ * Advances a tree in time with grandchild swaps at each level happening as a Poisson process with its own rate. All
+ * levels together are one Poisson process with the total rate, so the scheduler draws the time to the next event from
+ * that and then picks the level with an alias table (one uniform integer and one uniform real per event however many
+ * levels there are). Levels are collected and handed to the tree's batched swap in chunks.
+ *
+ * The scheduler draws times and levels from its own generator, the branches are still drawn by the tree.
+ */
+template <typename T, typename Rng=randomGenerator, bool ParentLinks=false>
+class HipsScheduler
+{
+public:
+	/*
+	 * Creates a scheduler where rates[L] is the number of grandchild swaps per unit time at level L
+	 */
+	HipsScheduler(HipsTree<T, Rng, ParentLinks>& tree, const std::vector<double>& rates, int randSeed)
+		: tree(tree), random(randSeed)
+	{
+		setRates(rates);
+	}
+	/*
+	 * Rates that grow by a constant factor per level (rate at level L is rootRate * growth^L)
+	 */
+	static std::vector<double> geometricRates(size_t levels, double rootRate, double growth)
+	{
+		std::vector<double> rates(levels);
+		for (size_t level = 0; level < levels; level++)
+			rates[level] = rootRate * pow(growth, (double) level);
+		return rates;
+	}
+	/*
+	 * Changes the rates (the time of the next event is drawn again)
+	 */
+	void setRates(const std::vector<double>& rates)
+	{
+		if (rates.empty())
+			throw std::runtime_error("No level rates given");
+		if (rates.size() > tree.getDepth() - 1)
+			throw std::runtime_error("More level rates than levels that can be swapped");
+		totalRate = 0;
+		for (auto rate : rates)
+		{
+			if (rate < 0 || !std::isfinite(rate))
+				throw std::runtime_error("Level rates have to be finite and not negative");
+			totalRate += rate;
+		}
+		if (totalRate <= 0)
+			throw std::runtime_error("At least one level rate has to be positive");
+		buildAliasTable(rates);
+		nextEventTime = time + drawWaitingTime();
+	}
+	/*
+	 * Does every event up to endTime and returns how many there were
+	 */
+	size_t advance(double endTime)
+	{
+		size_t events = 0;
+		levels.clear();
+		while (nextEventTime <= endTime)
+		{
+			levels.push_back(drawLevel());
+			nextEventTime += drawWaitingTime();
+			if (levels.size() == batchSize)
+			{
+				tree.swapRandomGrandchildrenBatch(levels);
+				events += levels.size();
+				levels.clear();
+			}
+		}
+		tree.swapRandomGrandchildrenBatch(levels);
+		events += levels.size();
+		time = std::max(time, endTime);
+		return events;
+	}
+	/*
+	 * Returns the current simulation time
+	 */
+	double getTime()
+	{
+		return time;
+	}
+	/*
+	 * Returns the sum of the level rates
+	 */
+	double getTotalRate()
+	{
+		return totalRate;
+	}
+
+private:
+	// Vose's alias method, level i is kept with probability[i] otherwise it becomes alias[i]
+	void buildAliasTable(const std::vector<double>& rates)
+	{
+		size_t n = rates.size();
+		probability.assign(n, 1.0);
+		alias.resize(n);
+		std::vector<double> scaled(n);
+		std::vector<size_t> small, large;
+		for (size_t i = 0; i < n; i++)
+		{
+			alias[i] = i;
+			scaled[i] = rates[i] * n / totalRate;
+			(scaled[i] < 1.0 ? small : large).push_back(i);
+		}
+		while (!small.empty() && !large.empty())
+		{
+			size_t less = small.back(), more = large.back();
+			small.pop_back();
+			probability[less] = scaled[less];
+			alias[less] = more;
+			scaled[more] -= 1.0 - scaled[less];
+			if (scaled[more] < 1.0)
+			{
+				large.pop_back();
+				small.push_back(more);
+			}
+		}
+		// whatever is left over is 1 up to rounding
+		for (auto i : small)
+			probability[i] = 1.0;
+		for (auto i : large)
+			probability[i] = 1.0;
+	}
+	size_t drawLevel()
+	{
+		size_t i = random.getRandInt(probability.size() - 1);
+		return random.getRand() < probability[i] ? i : alias[i];
+	}
+	double drawWaitingTime()
+	{
+		double u;
+		do
+			u = random.getRand();
+		while (u == 0.0);
+		return -log(u) / totalRate;
+	}
+
+	static constexpr size_t batchSize = 4096;
+
+	HipsTree<T, Rng, ParentLinks>& tree;
+	Rng random;
+	std::vector<double> probability;
+	std::vector<size_t> alias;
+	std::vector<size_t> levels;
+	double totalRate = 0;
+	double time = 0;
+	double nextEventTime = 0;
+};
+
+#endif //HIPSSCHEDULER_H
@@ -1,13 +1,32 @@
 #ifndef HIPSTREE_H
 #define HIPSTREE_H
 
+#include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <ctime>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <sstream>
-#include <stack>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#include "Mixing.h"
+#include "NodeArena.h"
+#include "ThreadPool.h"
+#include "TreeStats.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define HIPSTREE_PREFETCH(address) __builtin_prefetch(address)
+#else
+#define HIPSTREE_PREFETCH(address)
+#endif
+
 // This is the randomGenerator.h located at
 // BYUIgnite:SEC/source/randomGenerator.h
 
@@ -17,24 +36,70 @@
 // the provided seed without the process id being added
 #include "randomGenerator.h"
 
+template <typename T, bool ParentLinks=false>
+class LeafNode;
+
+/*
+ * Parent link of a node, empty unless the tree keeps parent links
+ */
+template <typename N, bool ParentLinks>
+struct NodeParent
+{
+};
+template <typename N>
+struct NodeParent<N, true>
+{
+	N* parent = nullptr;
+};
+
 /*
  * Node class
+ *
+ * Internal nodes are plain Nodes and only hold their children (and their parent when ParentLinks is set). Leaves are
+ * LeafNodes which add the value inline, so the value accessors are only valid on a node where isLeaf() is true.
  */
-template <typename T>
-class Node
+template <typename T, bool ParentLinks=false>
+class Node : private NodeParent<Node<T, ParentLinks>, ParentLinks>
 {
 public:
-	T getValue()
+	Node() = default;
+	Node(const Node&) = delete;
+	Node& operator=(const Node&) = delete;
+	const T& getValue()
 	{
-		// This could cause a segfault if called on a node with a null data
+		// This is undefined if called on an internal node
 		// I am not adding an exception check here because this should be safe user side
-		return *value;
+		return asLeaf()->value;
+	}
+	T& getMutableValue()
+	{
+		return asLeaf()->value;
+	}
+	void setValue(const T& v)
+	{
+		asLeaf()->value = v;
 	}
-	void setValue(T v)
+	void setValue(T&& v)
 	{
-		delete value;
-		value = new T();
-		*value = v;
+		asLeaf()->value = std::move(v);
+	}
+	/*
+	 * Replaces the value with one constructed from args in place
+	 */
+	template <typename... Args>
+	void emplaceValue(Args&&... args)
+	{
+		T& value = asLeaf()->value;
+		if constexpr (std::is_nothrow_constructible<T, Args&&...>::value)
+		{
+			value.~T();
+			new (&value) T(std::forward<Args>(args)...);
+		}
+		else
+		{
+			// a constructor that throws after the old value is destroyed would leave the leaf without one
+			value = T(std::forward<Args>(args)...);
+		}
 	}
 	Node* getLeft()
 	{
@@ -44,13 +109,25 @@ public:
 	{
 		return right;
 	}
+	Node* getParent()
+	{
+		static_assert(ParentLinks, "Only nodes of a tree with parent links know their parent");
+		return this->parent;
+	}
+	// the parent link of the new child is kept up to date
 	void setLeft(Node* node)
 	{
 		left = node;
+		if constexpr (ParentLinks)
+			if (node != nullptr)
+				node->parent = this;
 	}
 	void setRight(Node* node)
 	{
 		right = node;
+		if constexpr (ParentLinks)
+			if (node != nullptr)
+				node->parent = this;
 	}
 	bool isLeaf()
 	{
@@ -62,95 +139,167 @@ public:
 	}
 	void inOrderValues(std::vector<T>& values)
 	{
-		if (isLeaf())
+		Node* stack[64];
+		size_t count = 0;
+		for (Node* node = this;;)
 		{
-			values.push_back(*value);
-		}
-		else
-		{
-			if (left != nullptr)
-				left->inOrderValues(values);
-			if (right != nullptr)
-				right->inOrderValues(values);
+			if (node->isLeaf())
+			{
+				values.push_back(node->asLeaf()->value);
+				if (count == 0)
+					return;
+				node = stack[--count];
+			}
+			else
+			{
+				stack[count++] = node->right;
+				node = node->left;
+			}
 		}
 	}
-	void inOrderNodes(std::vector<Node<T>*>& nodes)
+	void inOrderNodes(std::vector<Node*>& nodes)
 	{
-		if (isLeaf())
-		{
-			nodes.push_back(this);
-		}
-		else
+		Node* stack[64];
+		size_t count = 0;
+		for (Node* node = this;;)
 		{
-			if (left != nullptr)
-				left->inOrderNodes(nodes);
-			if (right != nullptr)
-				right->inOrderNodes(nodes);
+			if (node->isLeaf())
+			{
+				nodes.push_back(node);
+				if (count == 0)
+					return;
+				node = stack[--count];
+			}
+			else
+			{
+				stack[count++] = node->right;
+				node = node->left;
+			}
 		}
 	}
 
 private:
+	LeafNode<T, ParentLinks>* asLeaf()
+	{
+		return static_cast<LeafNode<T, ParentLinks>*>(this);
+	}
+
 	Node* left = nullptr;
 	Node* right = nullptr;
-	T* value = nullptr;
+};
+
+/*
+ * Leaf node class holds the value directly instead of through a separate allocation
+ */
+template <typename T, bool ParentLinks>
+class LeafNode : public Node<T, ParentLinks>
+{
+public:
+	LeafNode() : value() {}
+	explicit LeafNode(const T& v) : value(v) {}
+	explicit LeafNode(T&& v) : value(std::move(v)) {}
+	template <typename... Args>
+	explicit LeafNode(std::in_place_t, Args&&... args) : value(std::forward<Args>(args)...) {}
+
+private:
+	friend class Node<T, ParentLinks>;
+
+	T value;
 };
 
 /*
  * Tree class
+ *
+ * Rng is the generator policy the branches are drawn from (see FastRandom.h), the default matches BYUIgnite:SEC.
+ * With ParentLinks every node also keeps a pointer to its parent so positionOf can climb from a leaf to the root. That
+ * is 8 more bytes per node (a Node<size_t> goes from 16 to 24 bytes and a LeafNode<size_t> from 24 to 32), so it is
+ * off unless asked for.
  */
-template <typename T>
+template <typename T, typename Rng=randomGenerator, bool ParentLinks=false>
 class HipsTree
 {
 public:
+	// a tree has at most 2^63 leaves so no walk from the root is longer than this
+	static constexpr size_t maxDepth = 64;
+	// the nodes of this tree, Node<T> and LeafNode<T> unless it keeps parent links
+	using NodeType = Node<T, ParentLinks>;
+	using LeafType = LeafNode<T, ParentLinks>;
+
 	/*
 	 * Gets a shared pointer to a blank tree
 	 */
-	static std::shared_ptr<HipsTree<T>> getTree(int randSeed=time(nullptr))
+	static std::shared_ptr<HipsTree<T, Rng, ParentLinks>> getTree(int randSeed=time(nullptr))
 	{
-		return std::make_shared<HipsTree<T>>(randSeed);
+		return std::make_shared<HipsTree<T, Rng, ParentLinks>>(randSeed);
 	}
 	/*
 	 * Gets a shared pointer to a tree populated with a vector of leaves
 	 */
-	static std::shared_ptr<HipsTree<T>> getTree(const std::vector<T>& values, int randSeed=time(nullptr))
+	static std::shared_ptr<HipsTree<T, Rng, ParentLinks>> getTree(const std::vector<T>& values,
+	                                                              int randSeed=time(nullptr))
+	{
+		return std::make_shared<HipsTree<T, Rng, ParentLinks>>(values, randSeed);
+	}
+	static std::shared_ptr<HipsTree<T, Rng, ParentLinks>> getTree(std::vector<T>&& values, int randSeed=time(nullptr))
 	{
-		return std::make_shared<HipsTree<T>>(values, randSeed);
+		return std::make_shared<HipsTree<T, Rng, ParentLinks>>(std::move(values), randSeed);
 	}
 	/*
 	 * Default constructor (tricky to use without accidentally calling deconstructor)
 	 */
-	HipsTree(int randSeed)
+	HipsTree(int randSeed) : random(randSeed)
 	{
-		random = randomGenerator(randSeed);
 	};
 	/*
 	 * Constructor with values (tricky to use without accidentally calling deconstructor)
 	 */
-	explicit HipsTree(const std::vector<T>& values, int randSeed)
+	explicit HipsTree(const std::vector<T>& values, int randSeed) : random(randSeed)
 	{
-		random = randomGenerator(randSeed);
 		populateByVector(values);
 	}
+	explicit HipsTree(std::vector<T>&& values, int randSeed) : random(randSeed)
+	{
+		populateByVector(std::move(values));
+	}
 	/*
 	 * Populates the tree with a vector of leaves - the vector should be a power of 2
 	 */
 	void populateByVector(const std::vector<T>& values)
 	{
-		if (!isPowerOfTwo(values.size()))
+		populateByRange(values.begin(), values.end());
+	}
+	/*
+	 * Same as above but the values are moved into the leaves (values is left holding moved from elements)
+	 */
+	void populateByVector(std::vector<T>&& values)
+	{
+		populateByRange(std::make_move_iterator(values.begin()), std::make_move_iterator(values.end()));
+	}
+	/*
+	 * Populates the tree with the values in [first, last), each leaf is constructed straight from *it so a range of
+	 * move iterators moves them in (works with pointers for a span of values)
+	 */
+	template <typename It>
+	void populateByRange(It first, It last)
+	{
+		size_t count = std::distance(first, last);
+		if (!isPowerOfTwo(count))
 			throw std::runtime_error("Vector of values is not a power of 2 in size");
-		populateToLevel(log2(values.size()) + 1);
-		auto treeIt = TreeIterator(root);
-		for (const auto& value : values)
-		{
-			treeIt.next()->setValue(value);
-		}
+		size_t level = 1;
+		while (((size_t) 1 << (level - 1)) < count)
+			level++;
+		resetTree();
+		reserveNodes(level);
+		root = populateByRangeHelper(level, first);
+		depth = level;
 	}
 	/*
 	 * Populates the tree to a given number of layers filling the leaves with a given value
 	 */
-	void populateToLevelValue(size_t level, T value)
+	void populateToLevelValue(size_t level, const T& value)
 	{
 		resetTree();
+		reserveNodes(level);
 		root = populateToLevelValueHelper(level, value);
 		depth = level;
 	}
@@ -160,34 +309,129 @@ public:
 	void populateToLevel(size_t level)
 	{
 		resetTree();
+		reserveNodes(level);
 		root = populateToLevelHelper(level);
 		depth = level;
 	}
 	/*
-	 * Deletes all nodes and makes tree have size 0
+	 * Deletes all nodes and makes tree have size 0 (the node memory is kept for the next populate)
 	 */
 	void resetTree()
 	{
-		recursiveDelete(root);
+		internalArena.reset();
+		leafArena.reset();
 		root = nullptr;
 		depth = 0;
 	}
+	/*
+	 * Sets how node memory is allocated from the next populate on (see PageAllocation.h), this empties the tree and
+	 * frees its node memory. With a pool the pages are first touched by the pool's threads, so without interleaving
+	 * they are split over the NUMA nodes those threads run on (the pool has to outlive the tree or be unset).
+	 */
+	void setMemoryPolicy(const MemoryPolicy& policy, ThreadPool* pool=nullptr)
+	{
+		resetTree();
+		internalArena.release();
+		leafArena.release();
+		internalArena.setMemoryPolicy(policy, pool);
+		leafArena.setMemoryPolicy(policy, pool);
+	}
+	/*
+	 * Returns how the node memory is backed by huge pages and spread over the NUMA nodes
+	 */
+	PagePlacement getPlacement() const
+	{
+		PagePlacement placement = internalArena.placement();
+		placement.add(leafArena.placement());
+		return placement;
+	}
 	/*
 	 * Gets a vector of copies of the values of the leaves
 	 */
 	std::vector<T> inOrderValues()
+	{
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+#endif
+		std::vector<T> values;
+		if (depth > 0)
+			values.reserve((size_t) 1 << (depth - 1));
+		// assign would walk the tree twice, once to count the leaves
+		std::copy(begin(), end(), std::back_inserter(values));
+#ifdef HIPSTREE_STATS
+		TreeStats::record(stats.traversals, start);
+#endif
+		return values;
+	}
+	/*
+	 * Copies the values of the leaves in order into out, which needs room for every leaf. With a pool the subtrees a
+	 * few levels down are copied by different threads, each straight into its own part of out.
+	 */
+	void snapshot(T* out, ThreadPool* pool=nullptr)
+	{
+		if (depth == 0)
+			return;
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+#endif
+		if (pool == nullptr || pool->size() < 2)
+		{
+			std::copy(begin(), end(), out);
+#ifdef HIPSTREE_STATS
+			TreeStats::record(stats.snapshots, start);
+#endif
+			return;
+		}
+		// a few subtrees per thread so uneven threads still finish together
+		size_t splitLevel = 0;
+		while (((size_t) 1 << splitLevel) < 4 * pool->size() && splitLevel + 1 < depth)
+			splitLevel++;
+		auto subtrees = nodesAtLevel(splitLevel);
+		size_t leavesPerSubtree = (size_t) 1 << (depth - 1 - splitLevel);
+		pool->parallelFor(subtrees.size(), [&](size_t i) {
+			std::copy(iterator(subtrees[i]), iterator(), out + i * leavesPerSubtree);
+		});
+#ifdef HIPSTREE_STATS
+		TreeStats::record(stats.snapshots, start);
+#endif
+	}
+	/*
+	 * Same as above into a vector that is resized to the number of leaves (reusing a vector avoids allocating)
+	 */
+	void snapshot(std::vector<T>& buffer, ThreadPool* pool=nullptr)
+	{
+		buffer.resize(depth > 0 ? (size_t) 1 << (depth - 1) : 0);
+		snapshot(buffer.data(), pool);
+	}
+	/*
+	 * Moves the values of the leaves out in order and leaves the tree empty
+	 */
+	std::vector<T> extractValues()
 	{
 		std::vector<T> values;
-		root->inOrderValues(values);
+		if (depth > 0)
+			values.reserve((size_t) 1 << (depth - 1));
+		for (T& value : *this)
+			values.push_back(std::move(value));
+		resetTree();
 		return values;
 	}
 	/*
 	 * Gets a vector of pointers to the leaves
 	 */
-	std::vector<Node<T>*> inOrderLeaves()
+	std::vector<NodeType*> inOrderLeaves()
 	{
-		std::vector<Node<T>*> nodes;
-		root->inOrderNodes(nodes);
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+#endif
+		std::vector<NodeType*> nodes;
+		if (depth > 0)
+			nodes.reserve((size_t) 1 << (depth - 1));
+		for (auto it = begin(); it != end(); ++it)
+			nodes.push_back(it.getNode());
+#ifdef HIPSTREE_STATS
+		TreeStats::record(stats.traversals, start);
+#endif
 		return nodes;
 	}
 	/*
@@ -197,25 +441,110 @@ public:
 	void swapRandom()
 	{
 		size_t level = random.getRandInt(depth - 2);
-		swapRandomNodeHelper(root, level);
+		swapAtLevel(level);
 	}
 	/*
 	 * Uses random branches to reach a specified level then swaps those branches
 	 */
 	void swapRandomLevel(size_t level)
 	{
-		if (level > depth - 1)
+		if (depth == 0 || level > depth - 1)
 			throw std::runtime_error("Level too deep for swap");
-		swapRandomNodeHelper(root, level);
+		swapAtLevel(level);
 	}
 	/*
 	 * Swap grandchildren as used by hips code
 	 */
 	void swapRandomGrandchildrenLevel(size_t level)
+	{
+		if (depth < 2 || level > depth - 2)
+			throw std::runtime_error("Level too deep for grandchild swap");
+		swapGrandchildrenAtLevel(level);
+	}
+	/*
+	 * Does swap event number index with its branches drawn from the generator's stream for that event, so the result
+	 * does not depend on any other event (needs a counter based generator like PhiloxRandom)
+	 */
+	void swapEvent(uint64_t index, size_t level, bool grandchild)
+	{
+		random.beginEvent(index, (uint32_t) level);
+		if (grandchild)
+			swapRandomGrandchildrenLevel(level);
+		else
+			swapRandomLevel(level);
+	}
+	/*
+	 * Does count swapRandom calls at once, the random numbers are drawn in the same order so the tree ends up the same
+	 */
+	void swapRandomBatch(size_t count)
+	{
+		swapBatchHelper(count, false, [this]() { return (size_t) random.getRandInt(depth - 2); });
+	}
+	/*
+	 * Does count grandchild swaps at a level, giving the same tree as calling swapRandomGrandchildrenLevel count times
+	 */
+	void swapRandomGrandchildrenBatch(size_t level, size_t count)
 	{
 		if (level > depth - 2)
 			throw std::runtime_error("Level too deep for grandchild swap");
-		swapRandomGrandchildHelper(root, level);
+		swapBatchHelper(count, true, [level]() { return level; });
+	}
+	/*
+	 * Does one grandchild swap per entry of levels, giving the same tree as calling swapRandomGrandchildrenLevel for
+	 * each of them (all of the levels are checked before any swap is done)
+	 */
+	void swapRandomGrandchildrenBatch(const std::vector<size_t>& levels)
+	{
+		for (auto level : levels)
+			if (level > depth - 2)
+				throw std::runtime_error("Level too deep for grandchild swap");
+		auto it = levels.begin();
+		swapBatchHelper(levels.size(), true, [&it]() { return *it++; });
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a built in rule
+	 */
+	void setMixingRule(MixingRule rule, double fraction=1.0)
+	{
+		mixer.setRule(rule, fraction);
+	}
+	/*
+	 * Mixes the parcels that become siblings after a grandchild swap at level depth - 3 with a function
+	 */
+	void setMixingHook(std::function<void(T&, T&)> hook)
+	{
+		mixer.setHook(std::move(hook));
+	}
+	/*
+	 * Returns the generator the tree draws its branches from
+	 */
+	Rng& getRandomGenerator()
+	{
+		return random;
+	}
+	/*
+	 * Returns the statistics collected so far (all 0 unless compiled with HIPSTREE_STATS)
+	 */
+	const TreeStats& getStats()
+	{
+#ifdef HIPSTREE_STATS
+		stats.internalNodeBytes = internalArena.size() * sizeof(NodeType);
+		stats.leafBytes = leafArena.size() * sizeof(LeafType);
+		stats.reservedBytes = internalArena.capacity() * sizeof(NodeType) + leafArena.capacity() * sizeof(LeafType);
+		return stats;
+#else
+		static const TreeStats empty;
+		return empty;
+#endif
+	}
+	/*
+	 * Sets every statistic back to 0
+	 */
+	void resetStats()
+	{
+#ifdef HIPSTREE_STATS
+		stats.reset();
+#endif
 	}
 	/*
 	 * Returns the current depth of the tree in layers
@@ -225,51 +554,309 @@ public:
 		return depth;
 	}
 	/*
-	 * Deconstructor deletes nodes
+	 * Returns the root node (nullptr for an empty tree)
+	 */
+	NodeType* getRoot()
+	{
+		return root;
+	}
+	/*
+	 * Gets the nodes at a level from left to right (level 0 is the root)
+	 */
+	std::vector<NodeType*> nodesAtLevel(size_t level)
+	{
+		if (depth == 0 || level > depth - 1)
+			throw std::runtime_error("Level too deep for this tree");
+		std::vector<NodeType*> nodes{root};
+		for (size_t i = 0; i < level; i++)
+		{
+			std::vector<NodeType*> children;
+			children.reserve(2 * nodes.size());
+			for (auto node : nodes)
+				children.push_back(node->getLeft()), children.push_back(node->getRight());
+			nodes.swap(children);
+		}
+		return nodes;
+	}
+	/*
+	 * Same as swapRandomLevel but starting from a node instead of the root and drawing from a given generator, so
+	 * separate subtrees can be worked on independently (level is counted from that node)
 	 */
-	~HipsTree()
+	void swapRandomLevelBelow(NodeType* node, size_t level, Rng& rng)
 	{
-		recursiveDelete(root);
+		swapRandomNodeHelper(node, level, rng);
+	}
+	/*
+	 * Same as swapRandomGrandchildrenLevel but starting from a node and drawing from a given generator
+	 */
+	void swapRandomGrandchildrenBelow(NodeType* node, size_t level, Rng& rng)
+	{
+		swapRandomGrandchildHelper(node, level, rng);
 	}
 
 	/*
-	 * Tree iterator class allows traversing the leaves of the tree
+	 * Leaf iterator class is a forward iterator over the values of the leaves for range-for and <algorithm>. It keeps
+	 * the right branches it still has to visit in a fixed array (a tree can not be deeper than 64 layers) so it never
+	 * allocates or recurses. Swapping branches while iterating invalidates it.
 	 */
-	class TreeIterator
+	template <bool Const>
+	class LeafIterator
 	{
 	public:
-		explicit TreeIterator(Node<T>* root)
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = T;
+		using difference_type = std::ptrdiff_t;
+		using pointer = typename std::conditional<Const, const T*, T*>::type;
+		using reference = typename std::conditional<Const, const T&, T&>::type;
+
+		LeafIterator() = default;
+		explicit LeafIterator(NodeType* root)
+		{
+			if (root != nullptr)
+				descend(root);
+		}
+		/*
+		 * Starts on leaf index of a perfect tree with the given number of layers
+		 */
+		LeafIterator(NodeType* root, size_t depth, size_t index)
 		{
-			Node<T>* currentNode = root;
-			while (currentNode != nullptr)
-				nodes.push(currentNode), currentNode = currentNode->getLeft();
+			NodeType* node = root;
+			for (size_t level = 0; level + 1 < depth; level++)
+			{
+				if ((index >> (depth - 2 - level)) & 1)
+				{
+					node = node->getRight();
+				}
+				else
+				{
+					pending[count++] = node->getRight();
+					node = node->getLeft();
+				}
+			}
+			current = node;
 		}
+		// a mutable iterator can be used where a const one is expected
+		template <bool OtherConst, typename = typename std::enable_if<Const && !OtherConst>::type>
+		LeafIterator(const LeafIterator<OtherConst>& other) : current(other.current), count(other.count),
+		                                                       pending(other.pending) {}
 
-		Node<T>* next()
+		reference operator*() const
+		{
+			return current->getMutableValue();
+		}
+		pointer operator->() const
+		{
+			return &current->getMutableValue();
+		}
+		LeafIterator& operator++()
+		{
+			if (count == 0)
+				current = nullptr;
+			else
+				descend(pending[--count]);
+			return *this;
+		}
+		LeafIterator operator++(int)
+		{
+			LeafIterator previous = *this;
+			++*this;
+			return previous;
+		}
+		bool operator==(const LeafIterator& other) const
 		{
-			if (nodes.empty())
-				return nullptr;
+			return current == other.current;
+		}
+		bool operator!=(const LeafIterator& other) const
+		{
+			return current != other.current;
+		}
+		/*
+		 * Returns the leaf node the iterator is on (nullptr at the end)
+		 */
+		NodeType* getNode() const
+		{
+			return current;
+		}
 
-			Node<T>* top = nodes.top();
+	private:
+		template <bool>
+		friend class LeafIterator;
+		friend class HipsTree;
 
-			Node<T>* currentNode = nodes.top()->getRight();
-			nodes.pop();
-			while (currentNode != nullptr)
-				nodes.push(currentNode), currentNode = currentNode->getLeft();
+		void descend(NodeType* node)
+		{
+			while (!node->isLeaf())
+			{
+				pending[count++] = node->getRight();
+				node = node->getLeft();
+			}
+			current = node;
+		}
 
-			if (top->isLeaf())
-				return top;
-			else
-				return next();
+		NodeType* current = nullptr;
+		size_t count = 0;
+		std::array<NodeType*, maxDepth> pending;
+	};
+
+	using iterator = LeafIterator<false>;
+	using const_iterator = LeafIterator<true>;
+
+	/*
+	 * Iterators over the values of the leaves in order
+	 */
+	iterator begin()
+	{
+		return iterator(root);
+	}
+	iterator end()
+	{
+		return iterator();
+	}
+	const_iterator begin() const
+	{
+		return const_iterator(root);
+	}
+	const_iterator end() const
+	{
+		return const_iterator();
+	}
+	const_iterator cbegin() const
+	{
+		return const_iterator(root);
+	}
+	const_iterator cend() const
+	{
+		return const_iterator();
+	}
+
+	/*
+	 * Returns the leaf at a position in O(depth)
+	 */
+	NodeType* leafAt(size_t index)
+	{
+		checkLeafIndex(index);
+		NodeType* node = root;
+		for (size_t level = 0; level + 1 < depth; level++)
+			node = (index >> (depth - 2 - level)) & 1 ? node->getRight() : node->getLeft();
+		return node;
+	}
+	/*
+	 * Returns an iterator that starts at the leaf at a position in O(depth)
+	 */
+	iterator iteratorAt(size_t index)
+	{
+		checkLeafIndex(index);
+		return iterator(root, depth, index);
+	}
+
+	/*
+	 * Subtree view class is the leaves under one node (one eddy) without copying anything, so looking at it costs its
+	 * own size instead of the whole tree's. Swaps inside the subtree show through the view. A swap above it moves the
+	 * node somewhere else, the view still follows the node but getOffset is no longer its position.
+	 */
+	class SubtreeView
+	{
+	public:
+		SubtreeView(NodeType* node, size_t layers, size_t offset) : node(node), layers(layers), offset(offset) {}
+
+		iterator begin() const
+		{
+			return iterator(node);
+		}
+		iterator end() const
+		{
+			return iterator();
+		}
+		/*
+		 * Returns the number of leaves
+		 */
+		size_t size() const
+		{
+			return (size_t) 1 << (layers - 1);
+		}
+		/*
+		 * Returns the leaf at a position within the subtree in O(layers)
+		 */
+		NodeType* leafAt(size_t index) const
+		{
+			if (index >= size())
+				throw std::out_of_range("Leaf index out of range");
+			return iterator(node, layers, index).getNode();
+		}
+		/*
+		 * Returns the position of the first leaf in the whole tree when the view was taken
+		 */
+		size_t getOffset() const
+		{
+			return offset;
+		}
+		/*
+		 * Returns the node at the top of the subtree
+		 */
+		NodeType* getNode() const
+		{
+			return node;
+		}
+
+	private:
+		NodeType* node;
+		size_t layers;
+		size_t offset;
+	};
+
+	/*
+	 * Returns a view of the subtree under node index (counted from the left) at a level in O(level)
+	 */
+	SubtreeView subtree(size_t level, size_t index)
+	{
+		if (depth == 0 || level > depth - 1)
+			throw std::runtime_error("Level too deep for this tree");
+		if (index >= ((size_t) 1 << level))
+			throw std::out_of_range("Subtree index out of range");
+		NodeType* node = root;
+		for (size_t i = 0; i < level; i++)
+			node = (index >> (level - 1 - i)) & 1 ? node->getRight() : node->getLeft();
+		return SubtreeView(node, depth - level, index << (depth - 1 - level));
+	}
+	/*
+	 * Returns the current position of a leaf by following the parent links up in O(depth), only for a tree with
+	 * ParentLinks. Leaves stay the same nodes when they are swapped around, so keeping the node of a parcel is enough to
+	 * track it over time.
+	 */
+	size_t positionOf(NodeType* leaf)
+	{
+		static_assert(ParentLinks, "positionOf needs a tree with parent links (HipsTree<T, Rng, true>)");
+		size_t position = 0;
+		size_t bit = 0;
+		for (NodeType* node = leaf; node->getParent() != nullptr; node = node->getParent(), bit++)
+			if (node->getParent()->getRight() == node)
+				position |= (size_t) 1 << bit;
+		return position;
+	}
+
+	/*
+	 * Tree iterator class allows traversing the leaves of the tree
+	 */
+	class TreeIterator
+	{
+	public:
+		explicit TreeIterator(NodeType* root) : leaf(root) {}
+
+		NodeType* next()
+		{
+			NodeType* node = leaf.getNode();
+			if (node != nullptr)
+				++leaf;
+			return node;
 		}
 
 		bool hasNext()
 		{
-			return !nodes.empty();
+			return leaf.getNode() != nullptr;
 		}
 
 	private:
-		std::stack<Node<T>*> nodes;
+		LeafIterator<false> leaf;
 	};
 
 	/*
@@ -300,78 +887,210 @@ private:
 	 * Various helper functions and members
 	 */
 
-	void swapRandomNodeHelper(Node<T>* node, size_t level)
+	// random branches down from a node to a level below it
+	static NodeType* walkDown(NodeType* node, size_t level, Rng& rng)
 	{
-		if (level == 0)
-		{
-			node->swapBranches();
-		}
+		for (; level > 0; level--)
+			node = rng.getRandInt(1) ? node->getLeft() : node->getRight();
+		return node;
+	}
+	void swapRandomNodeHelper(NodeType* node, size_t level, Rng& rng)
+	{
+		walkDown(node, level, rng)->swapBranches();
+	}
+	void swapRandomGrandchildHelper(NodeType* node, size_t level, Rng& rng)
+	{
+		node = walkDown(node, level, rng);
+		bool leftGrandchildLeft = rng.getRandInt(1);
+		bool rightGrandchildLeft = rng.getRandInt(1);
+		swapGrandchildren(node, leftGrandchildLeft, rightGrandchildLeft);
+	}
+	// the tree's own single swaps, the only ones that are timed
+	void swapAtLevel(size_t level)
+	{
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+		NodeType* node = walkDown(root, level, random);
+		uint64_t walked = TreeStats::now();
+		node->swapBranches();
+		stats.recordSwap(level, false, start, walked, TreeStats::now());
+#else
+		swapRandomNodeHelper(root, level, random);
+#endif
+	}
+	void swapGrandchildrenAtLevel(size_t level)
+	{
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+		NodeType* node = walkDown(root, level, random);
+		uint64_t walked = TreeStats::now();
+		bool leftGrandchildLeft = random.getRandInt(1);
+		bool rightGrandchildLeft = random.getRandInt(1);
+		swapGrandchildren(node, leftGrandchildLeft, rightGrandchildLeft);
+		stats.recordSwap(level, true, start, walked, TreeStats::now());
+#else
+		swapRandomGrandchildHelper(root, level, random);
+#endif
+	}
+	void swapGrandchildren(NodeType* node, bool leftGrandchildLeft, bool rightGrandchildLeft)
+	{
+		NodeType* leftGrandchild = leftGrandchildLeft ? node->getLeft()->getLeft() : node->getLeft()->getRight();
+		NodeType* rightGrandchild = rightGrandchildLeft ? node->getRight()->getLeft() : node->getRight()->getRight();
+		if (leftGrandchildLeft)
+			node->getLeft()->setLeft(rightGrandchild);
 		else
+			node->getLeft()->setRight(rightGrandchild);
+		if (rightGrandchildLeft)
+			node->getRight()->setLeft(leftGrandchild);
+		else
+			node->getRight()->setRight(leftGrandchild);
+		if (mixer.isActive() && leftGrandchild != nullptr && leftGrandchild->isLeaf())
 		{
-			if (random.getRandInt(1))
-				swapRandomNodeHelper(node->getLeft(), level - 1);
-			else
-				swapRandomNodeHelper(node->getRight(), level - 1);
+			// both children now hold a new pair of parcels
+			mixer.mixPair(node->getLeft()->getLeft()->getMutableValue(), node->getLeft()->getRight()->getMutableValue());
+			mixer.mixPair(node->getRight()->getLeft()->getMutableValue(), node->getRight()->getRight()->getMutableValue());
 		}
 	}
-	void swapRandomGrandchildHelper(Node<T>* node, size_t level)
+
+	/*
+	 * Batched swaps draw the branch bits of each swap up front, then walk a group of swaps one level at a time so the
+	 * node loads of different walks overlap. A swap whose walk would pass below the node of an earlier swap in the
+	 * group has to see that swap done first, so it starts a new group.
+	 */
+
+	struct BatchSwap
 	{
-		if (level == 0)
+		size_t level;
+		// bit i is the branch taken at level i (1 is left like the single swaps)
+		uint64_t path;
+		bool leftGrandchildLeft;
+		bool rightGrandchildLeft;
+	};
+
+	static constexpr size_t batchWidth = 8;
+
+	template <typename NextLevel>
+	void swapBatchHelper(size_t count, bool grandchildren, NextLevel nextLevel)
+	{
+#ifdef HIPSTREE_STATS
+		uint64_t start = TreeStats::now();
+#endif
+		BatchSwap batch[batchWidth];
+		size_t pending = 0;
+		for (size_t i = 0; i < count; i++)
 		{
-			bool leftGrandchildLeft = random.getRandInt(1);
-			bool rightGrandchildLeft = random.getRandInt(1);
-			Node<T>* leftGrandchild = leftGrandchildLeft ? node->getLeft()->getLeft() : node->getLeft()->getRight();
-			Node<T>* rightGrandchild = rightGrandchildLeft % 2 ? node->getRight()->getLeft() : node->getRight()->getRight();
-			if (leftGrandchildLeft)
-				node->getLeft()->setLeft(rightGrandchild);
-			else
-				node->getLeft()->setRight(rightGrandchild);
-			if (rightGrandchildLeft)
-				node->getRight()->setLeft(leftGrandchild);
-			else
-				node->getRight()->setRight(leftGrandchild);
+			BatchSwap swap{nextLevel(), 0, false, false};
+			for (size_t s = 0; s < swap.level; s++)
+				if (random.getRandInt(1))
+					swap.path |= (uint64_t) 1 << s;
+			if (grandchildren)
+			{
+				swap.leftGrandchildLeft = random.getRandInt(1);
+				swap.rightGrandchildLeft = random.getRandInt(1);
+			}
+#ifdef HIPSTREE_STATS
+			stats.countBatched(swap.level, grandchildren);
+#endif
+			if (pending == batchWidth || batchConflict(batch, pending, swap))
+			{
+				runBatch(batch, pending, grandchildren);
+				pending = 0;
+			}
+			batch[pending++] = swap;
 		}
-		else
+		runBatch(batch, pending, grandchildren);
+#ifdef HIPSTREE_STATS
+		TreeStats::record(stats.batches, start);
+#endif
+	}
+	static bool batchConflict(const BatchSwap* batch, size_t pending, const BatchSwap& swap)
+	{
+		for (size_t i = 0; i < pending; i++)
 		{
-			if (random.getRandInt(1))
-				swapRandomGrandchildHelper(node->getLeft(), level - 1);
-			else
-				swapRandomGrandchildHelper(node->getRight(), level - 1);
+			uint64_t prefix = ((uint64_t) 1 << batch[i].level) - 1;
+			if (swap.level > batch[i].level && ((swap.path ^ batch[i].path) & prefix) == 0)
+				return true;
 		}
+		return false;
 	}
-	void recursiveDelete(Node<T>* node)
+	void runBatch(const BatchSwap* batch, size_t pending, bool grandchildren)
 	{
-		if (node != nullptr)
+		NodeType* nodes[batchWidth];
+		size_t maxLevel = 0;
+		for (size_t i = 0; i < pending; i++)
 		{
-			recursiveDelete(node->getLeft());
-			recursiveDelete(node->getRight());
-			delete node;
+			nodes[i] = root;
+			maxLevel = std::max(maxLevel, batch[i].level);
+		}
+		for (size_t s = 0; s < maxLevel; s++)
+		{
+			for (size_t i = 0; i < pending; i++)
+			{
+				if (s < batch[i].level)
+				{
+					nodes[i] = (batch[i].path >> s) & 1 ? nodes[i]->getLeft() : nodes[i]->getRight();
+					HIPSTREE_PREFETCH(nodes[i]);
+				}
+			}
+		}
+		for (size_t i = 0; i < pending; i++)
+		{
+			if (grandchildren)
+				swapGrandchildren(nodes[i], batch[i].leftGrandchildLeft, batch[i].rightGrandchildLeft);
+			else
+				nodes[i]->swapBranches();
 		}
 	}
-	Node<T>* populateToLevelValueHelper(size_t level, T value)
+
+	NodeType* populateToLevelValueHelper(size_t level, const T& value)
 	{
+		if (level == 1)
+			return leafArena.allocate(value);
 		if (level > 0)
 		{
-			auto node = new Node<T>();
-			if (level == 1)
-				node->setValue(value);
+			auto node = internalArena.allocate();
 			node->setLeft(populateToLevelValueHelper(level - 1, value));
 			node->setRight(populateToLevelValueHelper(level - 1, value));
 			return node;
 		}
 		return nullptr;
 	}
-	Node<T>* populateToLevelHelper(size_t level)
+	template <typename It>
+	NodeType* populateByRangeHelper(size_t level, It& it)
 	{
+		if (level == 1)
+			return leafArena.allocate(std::in_place, *it++);
+		auto node = internalArena.allocate();
+		node->setLeft(populateByRangeHelper(level - 1, it));
+		node->setRight(populateByRangeHelper(level - 1, it));
+		return node;
+	}
+	NodeType* populateToLevelHelper(size_t level)
+	{
+		if (level == 1)
+			return leafArena.allocate();
 		if (level > 0)
 		{
-			auto node = new Node<T>();
+			auto node = internalArena.allocate();
 			node->setLeft(populateToLevelHelper(level - 1));
 			node->setRight(populateToLevelHelper(level - 1));
 			return node;
 		}
 		return nullptr;
 	}
+	void checkLeafIndex(size_t index)
+	{
+		if (depth == 0 || index >= ((size_t) 1 << (depth - 1)))
+			throw std::out_of_range("Leaf index out of range");
+	}
+	void reserveNodes(size_t level)
+	{
+		if (level > 0)
+		{
+			internalArena.reserve(((size_t) 1 << (level - 1)) - 1);
+			leafArena.reserve((size_t) 1 << (level - 1));
+		}
+	}
 	bool isPowerOfTwo(int n)
 	{
 		if (n == 0)
@@ -379,9 +1098,16 @@ private:
 		return (ceil(log2(n)) == floor(log2(n)));
 	}
 
-	Node<T>* root = nullptr;
+	// own every node of the tree, nodes are built depth first so each subtree is contiguous and the leaves are in order
+	NodeArena<NodeType> internalArena;
+	NodeArena<LeafType> leafArena;
+	MixingKernel<T> mixer;
+	NodeType* root = nullptr;
 	size_t depth = 0;
-	randomGenerator random;
+	Rng random;
+#ifdef HIPSTREE_STATS
+	TreeStats stats;
+#endif
 };
 
 #endif //HIPSTREE_H
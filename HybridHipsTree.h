@@ -0,0 +1,106 @@
+#ifndef HYBRIDHIPSTREE_H
+#define HYBRIDHIPSTREE_H
+
+#include <ctime>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "BlockHipsTree.h"
+
+/*
+ * Leaf vector class is the storage of a hybrid tree, the blocks are one vector in memory
+ */
+template <typename T>
+class LeafVector
+{
+public:
+	// a block fits in L1 so a swap just below the block level stays in cache
+	static constexpr size_t defaultBlockBytes = (size_t) 16 << 10;
+
+	T* allocate(size_t count)
+	{
+		leaves.clear();
+		leaves.resize(count);
+		return leaves.data();
+	}
+	T* adopt(std::vector<T>&& values)
+	{
+		leaves = std::move(values);
+		return leaves.data();
+	}
+	std::vector<T> extract()
+	{
+		std::vector<T> values = std::move(leaves);
+		leaves.clear();
+		return values;
+	}
+	void release()
+	{
+		leaves.clear();
+		leaves.shrink_to_fit();
+	}
+	void flush()
+	{
+	}
+	void prefetch(const T*, size_t)
+	{
+	}
+
+private:
+	std::vector<T> leaves;
+};
+
+/*
+ * Hybrid tree class
+ *
+ * Sits between HipsTree and FlatHipsTree. The top levels are a table of block handles like the pointer tree, so a swap
+ * near the root exchanges a few handles instead of moving half the leaves, and the levels below are contiguous blocks
+ * like the flat tree, so a low swap is a short memory swap and traversals and snapshots stream through memory. See
+ * BlockHipsTree for how the block level is picked.
+ */
+template <typename T, typename Rng=randomGenerator>
+class HybridHipsTree : public BlockHipsTree<T, LeafVector<T>, Rng>
+{
+public:
+	/*
+	 * Gets a shared pointer to a blank tree
+	 */
+	static std::shared_ptr<HybridHipsTree<T, Rng>> getTree(int randSeed=time(nullptr))
+	{
+		return std::make_shared<HybridHipsTree<T, Rng>>(randSeed);
+	}
+	/*
+	 * Gets a shared pointer to a tree populated with a vector of leaves
+	 */
+	static std::shared_ptr<HybridHipsTree<T, Rng>> getTree(const std::vector<T>& values, int randSeed=time(nullptr))
+	{
+		return std::make_shared<HybridHipsTree<T, Rng>>(values, randSeed);
+	}
+	static std::shared_ptr<HybridHipsTree<T, Rng>> getTree(std::vector<T>&& values, int randSeed=time(nullptr))
+	{
+		return std::make_shared<HybridHipsTree<T, Rng>>(std::move(values), randSeed);
+	}
+	/*
+	 * Default constructor, blockBytes is how big the blocks below the table are at most
+	 */
+	explicit HybridHipsTree(int randSeed, size_t blockBytes=LeafVector<T>::defaultBlockBytes)
+		: BlockHipsTree<T, LeafVector<T>, Rng>(randSeed, blockBytes)
+	{
+	}
+	/*
+	 * Constructor with values
+	 */
+	HybridHipsTree(const std::vector<T>& values, int randSeed)
+		: BlockHipsTree<T, LeafVector<T>, Rng>(randSeed, LeafVector<T>::defaultBlockBytes)
+	{
+		this->populateByVector(values);
+	}
+	HybridHipsTree(std::vector<T>&& values, int randSeed)
+		: BlockHipsTree<T, LeafVector<T>, Rng>(randSeed, LeafVector<T>::defaultBlockBytes)
+	{
+		this->populateByVector(std::move(values));
+	}
+};
+
+#endif //HYBRIDHIPSTREE_H
@@ -0,0 +1,78 @@
+#ifndef LEAFHANDLE_H
+#define LEAFHANDLE_H
+
+#include <cstddef>
+#include <utility>
+
+/*
+ * Leaf handle class
+ *
+ * The trees that keep their leaves in arrays have no nodes to hand out, their iterators and inOrderLeaves give one of
+ * these instead. It has the value accessors of HipsTree's Node and is used the same way, it->getValue() and
+ * it->setValue(v) work on it just like on a Node pointer (and it compares equal to nullptr past the last leaf), so code
+ * written against one tree works with the others. A handle points into the tree and is only valid until the next swap
+ * or populate.
+ */
+template <typename T>
+class LeafHandle
+{
+public:
+	LeafHandle(std::nullptr_t=nullptr) : leaf(nullptr) {}
+	explicit LeafHandle(T* leaf) : leaf(leaf) {}
+
+	const T& getValue() const
+	{
+		return *leaf;
+	}
+	T& getMutableValue() const
+	{
+		return *leaf;
+	}
+	void setValue(const T& v) const
+	{
+		*leaf = v;
+	}
+	void setValue(T&& v) const
+	{
+		*leaf = std::move(v);
+	}
+	/*
+	 * Replaces the value with one constructed from args
+	 */
+	template <typename... Args>
+	void emplaceValue(Args&&... args) const
+	{
+		*leaf = T(std::forward<Args>(args)...);
+	}
+	/*
+	 * Lets a handle be used like a Node pointer
+	 */
+	const LeafHandle* operator->() const
+	{
+		return this;
+	}
+	bool operator==(std::nullptr_t) const
+	{
+		return leaf == nullptr;
+	}
+	bool operator!=(std::nullptr_t) const
+	{
+		return leaf != nullptr;
+	}
+	explicit operator bool() const
+	{
+		return leaf != nullptr;
+	}
+	/*
+	 * Returns the address of the value in the tree
+	 */
+	T* get() const
+	{
+		return leaf;
+	}
+
+private:
+	T* leaf;
+};
+
+#endif //LEAFHANDLE_H
@@ -0,0 +1,161 @@
+#ifndef MAPPEDHIPSTREE_H
+#define MAPPEDHIPSTREE_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "BlockHipsTree.h"
+
+/*
+ * Leaf file class is the storage of a mapped tree, the blocks are a file mapped into memory
+ */
+template <typename T>
+class LeafFile
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Leaves live in a file so they have to be trivially copyable");
+
+public:
+	// a few pages of file per block, a swap just below the block level only moves half of one
+	static constexpr size_t defaultBlockBytes = (size_t) 64 << 10;
+
+	/*
+	 * Constructor with the file to keep the leaves in (created or overwritten on the first populate)
+	 */
+	explicit LeafFile(const std::string& path) : path(path)
+	{
+	}
+	LeafFile(const LeafFile&) = delete;
+	LeafFile& operator=(const LeafFile&) = delete;
+	/*
+	 * Deconstructor unmaps and closes the file (the kernel still writes changed pages back)
+	 */
+	~LeafFile()
+	{
+		unmap();
+		if (file >= 0)
+			close(file);
+	}
+	/*
+	 * Sizes the file for count leaves and maps it, truncating first drops the old contents so the leaves are zero bytes
+	 */
+	T* allocate(size_t count)
+	{
+		unmap();
+		if (file < 0)
+			file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+		if (file < 0)
+			throw std::runtime_error("Could not open tree file " + path + ": " + strerror(errno));
+		if (ftruncate(file, 0) != 0 || ftruncate(file, (off_t) (count * sizeof(T))) != 0)
+			throw std::runtime_error("Could not size tree file " + path + ": " + strerror(errno));
+		if (count == 0)
+			return nullptr;
+		void* memory = mmap(nullptr, count * sizeof(T), PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (memory == MAP_FAILED)
+			throw std::runtime_error("Could not map tree file " + path + ": " + strerror(errno));
+		// swaps below the block level jump around the file, reading ahead would only evict useful pages
+		madvise(memory, count * sizeof(T), MADV_RANDOM);
+		leaves = (T*) memory;
+		leafCount = count;
+		return leaves;
+	}
+	T* adopt(std::vector<T>&& values)
+	{
+		allocate(values.size());
+		std::copy(values.begin(), values.end(), leaves);
+		return leaves;
+	}
+	std::vector<T> extract()
+	{
+		std::vector<T> values(leaves, leaves + leafCount);
+		release();
+		return values;
+	}
+	/*
+	 * Unmaps the file and truncates it
+	 */
+	void release()
+	{
+		unmap();
+		if (file >= 0 && ftruncate(file, 0) != 0)
+			throw std::runtime_error("Could not truncate tree file " + path + ": " + strerror(errno));
+	}
+	/*
+	 * Writes changed pages back to the file and waits for it
+	 */
+	void flush()
+	{
+		if (leaves != nullptr && msync(leaves, leafCount * sizeof(T), MS_SYNC) != 0)
+			throw std::runtime_error("Could not write tree file " + path + ": " + strerror(errno));
+	}
+	void prefetch(const T* first, size_t count)
+	{
+		uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+		uintptr_t start = (uintptr_t) first / page * page;
+		madvise((void*) start, (uintptr_t) (first + count) - start, MADV_WILLNEED);
+	}
+	/*
+	 * Returns the path of the file
+	 */
+	const std::string& getPath() const
+	{
+		return path;
+	}
+
+private:
+	void unmap()
+	{
+		if (leaves != nullptr)
+			munmap(leaves, leafCount * sizeof(T));
+		leaves = nullptr;
+		leafCount = 0;
+	}
+
+	std::string path;
+	int file = -1;
+	T* leaves = nullptr;
+	size_t leafCount = 0;
+};
+
+/*
+ * Mapped tree class
+ *
+ * The same tree for trees that do not fit in memory. The leaves live in a file that is mapped into memory, so the
+ * kernel pages them in and writes them back as needed, and only the table of blocks (see BlockHipsTree) is kept in
+ * RAM. A swap at or above the block level only exchanges entries of that table, a swap below it only touches the pages
+ * of that subtree.
+ *
+ * The file is left behind when the tree is gone. After materialize it holds the leaves in order as raw values.
+ */
+template <typename T, typename Rng=randomGenerator>
+class MappedHipsTree : public BlockHipsTree<T, LeafFile<T>, Rng>
+{
+public:
+	/*
+	 * Gets a shared pointer to a blank tree stored in a file
+	 */
+	static std::shared_ptr<MappedHipsTree<T, Rng>> getTree(const std::string& path, int randSeed=time(nullptr))
+	{
+		return std::make_shared<MappedHipsTree<T, Rng>>(path, randSeed);
+	}
+	/*
+	 * Constructor with the file to keep the leaves in (created or overwritten on the first populate)
+	 */
+	MappedHipsTree(const std::string& path, int randSeed, size_t blockBytes=LeafFile<T>::defaultBlockBytes)
+		: BlockHipsTree<T, LeafFile<T>, Rng>(randSeed, blockBytes, path)
+	{
+	}
+};
+
+#endif //MAPPEDHIPSTREE_H
@@ -90,6 +90,8 @@ public:
 	MTRand( const uint32& oneSeed );  // initialize with a simple uint32
 	MTRand( uint32 *const bigSeed, uint32 const seedLength = N );  // or an array
 	MTRand();  // auto-initialize with /dev/urandom or time() and clock()
+	MTRand( const MTRand& o );  // copy state and repoint pNext into our own state
+	MTRand& operator=( const MTRand& o );
 
 	// Do NOT use for CRYPTOGRAPHY without securely hashing several returned
 	// values together, otherwise the generator state can be learned after
@@ -146,6 +148,18 @@ inline MTRand::MTRand( uint32 *const bigSeed, const uint32 seedLength )
 inline MTRand::MTRand()
 { seed(); }
 
+inline MTRand::MTRand( const MTRand& o )
+{ *this = o; }
+
+inline MTRand& MTRand::operator=( const MTRand& o )
+{
+	// The default copy would leave pNext pointing into the state of o
+	for( int i = 0; i < N; ++i ) state[i] = o.state[i];
+	left = o.left;
+	pNext = &state[o.pNext - o.state];
+	return *this;
+}
+
 inline double MTRand::rand()
 { return double(randInt()) * (1.0/4294967295.0); }
 
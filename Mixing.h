@@ -0,0 +1,145 @@
+#ifndef MIXING_H
+#define MIXING_H
+
+#include <cmath>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+/*
+ * Ways two paired parcels can mix
+ *
+ * FullAverage gives both parcels the mean of the pair. Partial moves each parcel a fraction of the way to the mean
+ * (a fraction of 1 is the same as FullAverage). Custom calls a user supplied function on the pair.
+ */
+enum class MixingRule
+{
+	None,
+	FullAverage,
+	Partial,
+	Custom
+};
+
+/*
+ * Mixing kernel class
+ *
+ * Holds the mixing rule a tree applies to the leaves that become siblings after a grandchild swap at the lowest level
+ * with grandchildren (depth - 3). The built in rules need an arithmetic type and work on whole arrays of pairs with a
+ * loop simple enough for the compiler to vectorize. Anything else can use a hook.
+ */
+template <typename T>
+class MixingKernel
+{
+public:
+	/*
+	 * Chooses one of the built in rules (fraction is only used by Partial)
+	 */
+	void setRule(MixingRule newRule, double newFraction=1.0)
+	{
+		if (newRule == MixingRule::Custom)
+			throw std::runtime_error("Use setHook for a custom mixing rule");
+		if (newRule != MixingRule::None && !std::is_arithmetic<T>::value)
+			throw std::runtime_error("Built in mixing rules need an arithmetic type, use a hook instead");
+		if (newFraction < 0 || newFraction > 1)
+			throw std::runtime_error("Mixing fraction has to be between 0 and 1");
+		rule = newRule;
+		fraction = newRule == MixingRule::FullAverage ? 1.0 : newFraction;
+		hook = nullptr;
+	}
+	/*
+	 * Uses a function that mixes a pair of parcels in place
+	 */
+	void setHook(std::function<void(T&, T&)> newHook)
+	{
+		hook = std::move(newHook);
+		rule = hook ? MixingRule::Custom : MixingRule::None;
+	}
+	/*
+	 * Returns the rule in use
+	 */
+	MixingRule getRule() const
+	{
+		return rule;
+	}
+	/*
+	 * Returns whether there is anything to do when parcels are paired
+	 */
+	bool isActive() const
+	{
+		return rule != MixingRule::None;
+	}
+	/*
+	 * Mixes one pair of parcels
+	 */
+	void mixPair(T& first, T& second) const
+	{
+		mixPairs(&first, &second, 1);
+	}
+	/*
+	 * Mixes first[i] with second[i] for every i in [0, count)
+	 */
+	void mixPairs(T* first, T* second, size_t count) const
+	{
+		if (rule == MixingRule::Custom)
+		{
+			for (size_t i = 0; i < count; i++)
+				hook(first[i], second[i]);
+		}
+		else if (rule != MixingRule::None)
+		{
+			mixArithmetic(first, 1, second, 1, count);
+		}
+	}
+	/*
+	 * Mixes data[2i] with data[2i + 1] for every i in [0, pairs), the layout of sibling leaves in a flat tree
+	 */
+	void mixAdjacentPairs(T* data, size_t pairs) const
+	{
+		if (rule == MixingRule::Custom)
+		{
+			for (size_t i = 0; i < pairs; i++)
+				hook(data[2 * i], data[2 * i + 1]);
+		}
+		else if (rule != MixingRule::None)
+		{
+			mixArithmetic(data, 2, data + 1, 2, pairs);
+		}
+	}
+
+private:
+	void mixArithmetic(T* first, size_t firstStride, T* second, size_t secondStride, size_t count) const
+	{
+		if constexpr (std::is_floating_point<T>::value)
+		{
+			const T half = (T) (fraction / 2);
+			for (size_t i = 0; i < count; i++)
+			{
+				T a = first[i * firstStride];
+				T b = second[i * secondStride];
+				T shift = half * (b - a);
+				first[i * firstStride] = a + shift;
+				second[i * secondStride] = b - shift;
+			}
+		}
+		else if constexpr (std::is_arithmetic<T>::value)
+		{
+			// integer parcels are mixed in double, the second one takes the rounding so the sum is kept
+			const double half = fraction / 2;
+			for (size_t i = 0; i < count; i++)
+			{
+				T a = first[i * firstStride];
+				T b = second[i * secondStride];
+				T mixed = (T) llround((double) a + half * ((double) b - (double) a));
+				first[i * firstStride] = mixed;
+				second[i * secondStride] = (T) (a + b - mixed);
+			}
+		}
+	}
+
+	MixingRule rule = MixingRule::None;
+	double fraction = 1.0;
+	std::function<void(T&, T&)> hook;
+};
+
+#endif //MIXING_H
@@ -0,0 +1,267 @@
+#ifndef MULTISCALARHIPSTREE_H
+#define MULTISCALARHIPSTREE_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "HipsTree.h"
+#include "Mixing.h"
+
+/*
+ * Multi scalar tree class
+ *
+ * For parcels that carry many scalars (a temperature plus species for example). The scalars are kept as one
+ * contiguous array per field indexed by parcel, and the tree only holds parcel indices, so a swap moves indices and
+ * never the scalars. Operations on a field are plain loops over one array.
+ *
+ * Parcel i starts at position i. field(f)[i] is always parcel i, use inOrderField for the values in tree order.
+ */
+template <typename S=double, typename Rng=randomGenerator>
+class MultiScalarHipsTree
+{
+public:
+	/*
+	 * Creates an empty tree with a number of scalar fields per parcel
+	 */
+	MultiScalarHipsTree(size_t fieldCount, int randSeed) : fieldCount(fieldCount), tree(randSeed)
+	{
+		if (fieldCount == 0)
+			throw std::runtime_error("A multi scalar tree needs at least one field");
+	}
+	/*
+	 * Creates a tree to a given number of layers with every scalar set to 0
+	 */
+	void populateToLevel(size_t level)
+	{
+		if (level > 33)
+			throw std::runtime_error("Too many layers for 32 bit parcel indices");
+		parcelCount = level > 0 ? (size_t) 1 << (level - 1) : 0;
+		std::vector<uint32_t> parcels(parcelCount);
+		for (size_t i = 0; i < parcelCount; i++)
+			parcels[i] = (uint32_t) i;
+		if (parcelCount > 0)
+			tree.populateByVector(std::move(parcels));
+		else
+			tree.resetTree();
+		parcelLeaves = tree.inOrderLeaves();
+		data.assign(fieldCount * parcelCount, S());
+	}
+	/*
+	 * Returns a field indexed by parcel
+	 */
+	S* field(size_t f)
+	{
+		checkField(f);
+		return data.data() + f * parcelCount;
+	}
+	/*
+	 * Sets every parcel's value of a field (values[i] goes to parcel i)
+	 */
+	void setField(size_t f, const std::vector<S>& values)
+	{
+		if (values.size() != parcelCount)
+			throw std::runtime_error("Field values do not match the number of parcels");
+		std::copy(values.begin(), values.end(), field(f));
+	}
+	/*
+	 * Gets the values of a field in the current order of the leaves
+	 */
+	std::vector<S> inOrderField(size_t f)
+	{
+		const S* values = field(f);
+		std::vector<S> ordered;
+		ordered.reserve(parcelCount);
+		for (auto it = tree.getIterator(); it.hasNext();)
+			ordered.push_back(values[it.next()->getValue()]);
+		return ordered;
+	}
+	/*
+	 * Gets the parcel indices in the current order of the leaves
+	 */
+	std::vector<uint32_t> inOrderParcels()
+	{
+		return tree.inOrderValues();
+	}
+	/*
+	 * Returns the parcel at a position in O(depth)
+	 */
+	uint32_t parcelAt(size_t position)
+	{
+		return tree.leafAt(position)->getValue();
+	}
+	/*
+	 * Returns the current position of a parcel in O(depth)
+	 */
+	size_t positionOf(uint32_t parcel)
+	{
+		if (parcel >= parcelCount)
+			throw std::out_of_range("Parcel index out of range");
+		return tree.positionOf(parcelLeaves[parcel]);
+	}
+	/*
+	 * Swaps have the same meaning as for HipsTree
+	 */
+	void swapRandom()
+	{
+		tree.swapRandom();
+	}
+	void swapRandomLevel(size_t level)
+	{
+		tree.swapRandomLevel(level);
+	}
+	void swapRandomGrandchildrenLevel(size_t level)
+	{
+		tree.swapRandomGrandchildrenLevel(level);
+	}
+	void swapRandomGrandchildrenBatch(size_t level, size_t count)
+	{
+		tree.swapRandomGrandchildrenBatch(level, count);
+	}
+	void swapRandomGrandchildrenBatch(const std::vector<size_t>& levels)
+	{
+		tree.swapRandomGrandchildrenBatch(levels);
+	}
+	/*
+	 * Mixes every field of the parcels that become siblings after a grandchild swap at level depth - 3
+	 */
+	void setMixingRule(MixingRule rule, double fraction=1.0)
+	{
+		mixer.setRule(rule, fraction);
+		if (mixer.isActive())
+			tree.setMixingHook([this](uint32_t& a, uint32_t& b) { mixParcels(a, b); });
+		else
+			tree.setMixingHook(nullptr);
+	}
+	/*
+	 * Multiplies every value of a field by a factor
+	 */
+	void scaleField(size_t f, S factor)
+	{
+		S* values = field(f);
+		for (size_t i = 0; i < parcelCount; i++)
+			values[i] *= factor;
+	}
+	/*
+	 * Scales fields [first, first + count) of every parcel so they add up to 1 (parcels where they add up to 0 are
+	 * left alone)
+	 */
+	void normalizeFields(size_t first, size_t count)
+	{
+		if (count == 0)
+			return;
+		checkField(first + count - 1);
+		std::vector<S> sums(parcelCount, S());
+		S* total = sums.data();
+		for (size_t f = first; f < first + count; f++)
+		{
+			const S* values = field(f);
+			for (size_t i = 0; i < parcelCount; i++)
+				total[i] += values[i];
+		}
+		for (size_t i = 0; i < parcelCount; i++)
+			total[i] = total[i] != S() ? 1 / total[i] : 1;
+		for (size_t f = first; f < first + count; f++)
+		{
+			S* values = field(f);
+			for (size_t i = 0; i < parcelCount; i++)
+				values[i] *= total[i];
+		}
+	}
+	/*
+	 * Returns the sum of a field over every parcel
+	 */
+	S fieldSum(size_t f)
+	{
+		const S* values = field(f);
+		// independent partial sums so the loop can use vector registers without reassociating one sum
+		S partial[lanes] = {};
+		size_t i = 0;
+		for (; i + lanes <= parcelCount; i += lanes)
+			for (size_t j = 0; j < lanes; j++)
+				partial[j] += values[i + j];
+		S sum = S();
+		for (; i < parcelCount; i++)
+			sum += values[i];
+		for (size_t j = 0; j < lanes; j++)
+			sum += partial[j];
+		return sum;
+	}
+	/*
+	 * Returns the mean of a field over every parcel
+	 */
+	S fieldMean(size_t f)
+	{
+		return parcelCount > 0 ? fieldSum(f) / (S) parcelCount : S();
+	}
+	/*
+	 * Returns the variance of a field over every parcel
+	 */
+	S fieldVariance(size_t f)
+	{
+		if (parcelCount == 0)
+			return S();
+		const S* values = field(f);
+		S mean = fieldMean(f);
+		S partial[lanes] = {};
+		size_t i = 0;
+		for (; i + lanes <= parcelCount; i += lanes)
+			for (size_t j = 0; j < lanes; j++)
+				partial[j] += (values[i + j] - mean) * (values[i + j] - mean);
+		S sum = S();
+		for (; i < parcelCount; i++)
+			sum += (values[i] - mean) * (values[i] - mean);
+		for (size_t j = 0; j < lanes; j++)
+			sum += partial[j];
+		return sum / (S) parcelCount;
+	}
+	/*
+	 * Returns the current depth of the tree in layers
+	 */
+	size_t getDepth()
+	{
+		return tree.getDepth();
+	}
+	/*
+	 * Returns the number of parcels (leaves)
+	 */
+	size_t getParcelCount()
+	{
+		return parcelCount;
+	}
+	/*
+	 * Returns the number of scalar fields per parcel
+	 */
+	size_t getFieldCount()
+	{
+		return fieldCount;
+	}
+
+private:
+	void mixParcels(uint32_t a, uint32_t b)
+	{
+		S* values = data.data();
+		for (size_t f = 0; f < fieldCount; f++, values += parcelCount)
+			mixer.mixPair(values[a], values[b]);
+	}
+	void checkField(size_t f)
+	{
+		if (f >= fieldCount)
+			throw std::runtime_error("Field index out of range");
+	}
+
+	static constexpr size_t lanes = 8;
+
+	size_t fieldCount;
+	size_t parcelCount = 0;
+	// field f of parcel i is data[f * parcelCount + i]
+	std::vector<S> data;
+	MixingKernel<S> mixer;
+	// parent links so positionOf can climb from a parcel's leaf
+	HipsTree<uint32_t, Rng, true> tree;
+	// the leaf holding each parcel, leaves keep their parcel when swapped
+	std::vector<Node<uint32_t, true>*> parcelLeaves;
+};
+
+#endif //MULTISCALARHIPSTREE_H
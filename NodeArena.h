@@ -0,0 +1,198 @@
+#ifndef NODEARENA_H
+#define NODEARENA_H
+
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "PageAllocation.h"
+
+/*
+ * Node arena class
+ *
+ * Hands out nodes from a few large slabs owned by the tree instead of one heap allocation per node. Nodes allocated
+ * one after another are adjacent in memory, so a tree built depth first keeps every subtree in one contiguous range.
+ * Nothing is freed on its own: reset() drops every node at once and keeps the slabs for the next build, release()
+ * gives the memory back.
+ *
+ * With a memory policy other than the default the slabs are mapped from the kernel with huge pages and/or interleaved
+ * over the NUMA nodes (see PageAllocation.h). Given a pool, new slabs are touched by its threads before any node is put
+ * in them, which decides which NUMA node each page lands on.
+ */
+template <typename N>
+class NodeArena
+{
+public:
+	NodeArena() = default;
+	NodeArena(const NodeArena&) = delete;
+	NodeArena& operator=(const NodeArena&) = delete;
+	/*
+	 * Deconstructor destroys the nodes and frees the slabs
+	 */
+	~NodeArena()
+	{
+		release();
+	}
+	/*
+	 * Makes sure the next count allocations come from a single slab
+	 */
+	void reserve(size_t count)
+	{
+		// nothing to make room for, and a slab of 0 nodes would never fill up
+		if (count == 0)
+			return;
+		if (!slabs.empty() && slabs[current].capacity - slabs[current].used >= count)
+			return;
+		// slabs after the current one are empty, reuse one that is big enough
+		size_t next = (slabs.empty() || slabs[current].used == 0) ? current : current + 1;
+		for (size_t i = next; i < slabs.size(); i++)
+		{
+			if (slabs[i].capacity >= count)
+			{
+				std::swap(slabs[i], slabs[next]);
+				current = next;
+				return;
+			}
+		}
+		// nothing in use and nothing big enough, so drop the small slabs instead of keeping them around
+		if (size() == 0)
+			release();
+		addSlab(count);
+	}
+	/*
+	 * Constructs a node in the arena
+	 */
+	template <typename... Args>
+	N* allocate(Args&&... args)
+	{
+		while (slabs.empty() || slabs[current].used == slabs[current].capacity)
+		{
+			if (current + 1 < slabs.size())
+				current++;
+			else
+				addSlab(slabs.empty() ? minimumSlab : std::max(minimumSlab, 2 * slabs.back().capacity));
+		}
+		Slab& slab = slabs[current];
+		N* node = slab.nodes + slab.used;
+		new (node) N(std::forward<Args>(args)...);
+		slab.used++;
+		return node;
+	}
+	/*
+	 * Destroys every node but keeps the slabs for reuse
+	 */
+	void reset()
+	{
+		for (auto& slab : slabs)
+		{
+			destroy(slab);
+			slab.used = 0;
+		}
+		current = 0;
+	}
+	/*
+	 * Destroys every node and frees the slabs
+	 */
+	void release()
+	{
+		std::allocator<N> allocator;
+		for (auto& slab : slabs)
+		{
+			destroy(slab);
+			if (slab.mapped)
+				unmapPages(slab.nodes, slab.mappedBytes);
+			else
+				allocator.deallocate(slab.nodes, slab.capacity);
+		}
+		slabs.clear();
+		current = 0;
+	}
+	/*
+	 * Sets how slabs added from now on get their memory (the pool has to outlive the arena or be unset)
+	 */
+	void setMemoryPolicy(const MemoryPolicy& newPolicy, ThreadPool* newPool=nullptr)
+	{
+		policy = newPolicy;
+		pool = newPool;
+	}
+	/*
+	 * Returns where the slabs' memory is
+	 */
+	PagePlacement placement() const
+	{
+		PagePlacement total;
+		for (const auto& slab : slabs)
+			total.add(placementOf(slab.nodes, slab.capacity * sizeof(N)));
+		return total;
+	}
+	/*
+	 * Returns the number of nodes currently allocated
+	 */
+	size_t size() const
+	{
+		size_t count = 0;
+		for (const auto& slab : slabs)
+			count += slab.used;
+		return count;
+	}
+	/*
+	 * Returns the number of nodes the slabs can hold
+	 */
+	size_t capacity() const
+	{
+		size_t count = 0;
+		for (const auto& slab : slabs)
+			count += slab.capacity;
+		return count;
+	}
+
+private:
+	struct Slab
+	{
+		N* nodes;
+		size_t capacity;
+		size_t used;
+		// whether the slab came from mapPages instead of std::allocator, and the size to unmap
+		bool mapped;
+		size_t mappedBytes;
+	};
+
+	void addSlab(size_t count)
+	{
+		if (count == 0)
+			return;
+		Slab slab{nullptr, count, 0, false, 0};
+		if (policy.isDefault())
+		{
+			slab.nodes = std::allocator<N>().allocate(count);
+		}
+		else
+		{
+			slab.nodes = (N*) mapPages(count * sizeof(N), policy, slab.mappedBytes);
+			slab.mapped = true;
+			// the mapping is rounded up to whole huge pages, use all of it
+			slab.capacity = slab.mappedBytes / sizeof(N);
+		}
+		if (pool != nullptr)
+			touchPages(slab.nodes, slab.capacity * sizeof(N), pool);
+		slabs.push_back(slab);
+		current = slabs.size() - 1;
+	}
+	static void destroy(Slab& slab)
+	{
+		if (!std::is_trivially_destructible<N>::value)
+			for (size_t i = 0; i < slab.used; i++)
+				slab.nodes[i].~N();
+	}
+
+	static constexpr size_t minimumSlab = 1024;
+
+	std::vector<Slab> slabs;
+	size_t current = 0;
+	MemoryPolicy policy;
+	ThreadPool* pool = nullptr;
+};
+
+#endif //NODEARENA_H
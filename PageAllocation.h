@@ -0,0 +1,271 @@
+#ifndef PAGEALLOCATION_H
+#define PAGEALLOCATION_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "ThreadPool.h"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Page allocation
+ *
+ * Big trees spread their nodes over gigabytes, so every random walk from the root misses the TLB on 4 KiB pages and,
+ * when one thread builds the tree, all of it sits on one NUMA node. These map memory straight from the kernel with
+ * huge pages and optionally interleave it over the NUMA nodes. They only do something on Linux, anywhere else the
+ * memory comes from operator new and the summary only has the size.
+ *
+ * Transparent huge pages are asked for with madvise on a 2 MiB aligned mapping. Explicit huge pages (MAP_HUGETLB) need
+ * pages reserved in /proc/sys/vm/nr_hugepages, without them this falls back to transparent ones. Interleaving uses the
+ * mbind system call directly so there is no libnuma dependency, and is skipped where the kernel refuses it.
+ */
+
+enum class HugePages
+{
+	None,
+	Transparent,
+	Explicit
+};
+
+struct MemoryPolicy
+{
+	HugePages hugePages = HugePages::None;
+	// spread the pages round robin over every NUMA node the process may use
+	bool interleave = false;
+
+	bool isDefault() const
+	{
+		return hugePages == HugePages::None && !interleave;
+	}
+};
+
+/*
+ * Where some memory actually ended up
+ */
+struct PagePlacement
+{
+	size_t bytes = 0;
+	// how much of it the kernel backs with huge pages
+	size_t hugePageBytes = 0;
+	// NUMA node of evenly spread sample pages, pages that were never touched have no node yet
+	size_t sampledPages = 0;
+	size_t untouchedPages = 0;
+	std::vector<size_t> pagesPerNode;
+
+	void add(const PagePlacement& other)
+	{
+		bytes += other.bytes;
+		hugePageBytes += other.hugePageBytes;
+		sampledPages += other.sampledPages;
+		untouchedPages += other.untouchedPages;
+		if (pagesPerNode.size() < other.pagesPerNode.size())
+			pagesPerNode.resize(other.pagesPerNode.size());
+		for (size_t i = 0; i < other.pagesPerNode.size(); i++)
+			pagesPerNode[i] += other.pagesPerNode[i];
+	}
+	std::string toString() const
+	{
+		std::ostringstream out;
+		out << bytes << " bytes, " << hugePageBytes << " in huge pages";
+		if (sampledPages > 0)
+		{
+			out << ", of " << sampledPages << " sampled pages";
+			for (size_t node = 0; node < pagesPerNode.size(); node++)
+				if (pagesPerNode[node] > 0)
+					out << " " << pagesPerNode[node] << " on node " << node << ",";
+			out << " " << untouchedPages << " untouched";
+		}
+		return out.str();
+	}
+};
+
+/*
+ * Sizes and helpers the page functions share, kept in a struct so they do not take generic names in every file that
+ * includes a tree
+ */
+struct PageAllocation
+{
+	static constexpr size_t hugePageSize = (size_t) 2 << 20;
+	static constexpr size_t smallPageSize = 4096;
+	// pages placementOf asks the kernel about
+	static constexpr size_t placementSamples = 4096;
+
+	/*
+	 * Returns how many bytes of [start, end) are also in [first, last) (the two have to overlap)
+	 */
+	static size_t overlap(uintptr_t start, uintptr_t end, uintptr_t first, uintptr_t last)
+	{
+		return std::min(end, last) - std::max(start, first);
+	}
+};
+
+/*
+ * Maps at least bytes (more than 0) of memory with a policy, mappedBytes is set to what has to be passed to unmapPages
+ */
+inline void* mapPages(size_t bytes, const MemoryPolicy& policy, size_t& mappedBytes)
+{
+	if (bytes == 0)
+		throw std::runtime_error("Cannot map 0 bytes of pages");
+#ifdef __linux__
+	const size_t hugePage = PageAllocation::hugePageSize;
+	size_t size = (bytes + hugePage - 1) / hugePage * hugePage;
+	void* memory = MAP_FAILED;
+	if (policy.hugePages == HugePages::Explicit)
+		memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		// map a huge page more than needed and trim both ends so the start is aligned to a huge page
+		char* raw = (char*) mmap(nullptr, size + hugePage, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		                         -1, 0);
+		if (raw == MAP_FAILED)
+			throw std::bad_alloc();
+		char* aligned = (char*) (((uintptr_t) raw + hugePage - 1) / hugePage * hugePage);
+		if (aligned > raw)
+			munmap(raw, aligned - raw);
+		if (raw + size + hugePage > aligned + size)
+			munmap(aligned + size, raw + size + hugePage - (aligned + size));
+		memory = aligned;
+		if (policy.hugePages != HugePages::None)
+			madvise(memory, size, MADV_HUGEPAGE);
+	}
+	if (policy.interleave)
+	{
+		// MPOL_INTERLEAVE over the nodes get_mempolicy(MPOL_F_MEMS_ALLOWED) reports
+		const int interleave = 3;
+		const unsigned long memsAllowed = 4;
+		unsigned long nodes[16] = {};
+		unsigned long maxNode = sizeof(nodes) * 8;
+		if (syscall(SYS_get_mempolicy, nullptr, nodes, maxNode, nullptr, memsAllowed) == 0)
+			syscall(SYS_mbind, memory, size, interleave, nodes, maxNode, 0);
+	}
+	mappedBytes = size;
+	return memory;
+#else
+	(void) policy;
+	mappedBytes = bytes;
+	return ::operator new(bytes);
+#endif
+}
+
+/*
+ * Gives back memory from mapPages
+ */
+inline void unmapPages(void* memory, size_t mappedBytes)
+{
+#ifdef __linux__
+	munmap(memory, mappedBytes);
+#else
+	(void) mappedBytes;
+	::operator delete(memory);
+#endif
+}
+
+/*
+ * Writes to every page so it is placed now, by the pool's threads when there is a pool. Without interleaving the
+ * kernel puts a page on the NUMA node of the thread that touches it first, so the memory is partitioned over the
+ * nodes the pool runs on.
+ */
+inline void touchPages(void* memory, size_t bytes, ThreadPool* pool)
+{
+	const size_t hugePage = PageAllocation::hugePageSize;
+	const size_t smallPage = PageAllocation::smallPageSize;
+	char* first = (char*) memory;
+	size_t chunks = (bytes + hugePage - 1) / hugePage;
+	auto touch = [&](size_t chunk) {
+		char* end = first + std::min(bytes, (chunk + 1) * hugePage);
+		for (char* page = first + chunk * hugePage; page < end; page += smallPage)
+			*(volatile char*) page = 0;
+	};
+	if (pool != nullptr)
+	{
+		pool->parallelFor(chunks, touch);
+	}
+	else
+	{
+		for (size_t chunk = 0; chunk < chunks; chunk++)
+			touch(chunk);
+	}
+}
+
+/*
+ * Asks the kernel where memory is (huge page use from /proc/self/smaps, NUMA nodes of sample pages from move_pages)
+ */
+inline PagePlacement placementOf(const void* memory, size_t bytes)
+{
+	PagePlacement placement;
+	placement.bytes = bytes;
+#ifdef __linux__
+	const size_t smallPage = PageAllocation::smallPageSize;
+	uintptr_t first = (uintptr_t) memory;
+	uintptr_t last = first + bytes;
+
+	FILE* smaps = fopen("/proc/self/smaps", "r");
+	if (smaps != nullptr)
+	{
+		char line[512];
+		uintptr_t start = 0, end = 0;
+		bool overlaps = false;
+		while (fgets(line, sizeof(line), smaps) != nullptr)
+		{
+			unsigned long a, b, kb;
+			// only the lines starting a mapping have the form start-end
+			if (sscanf(line, "%lx-%lx ", &a, &b) == 2)
+			{
+				start = a;
+				end = b;
+				overlaps = start < last && end > first;
+			}
+			else if (overlaps && sscanf(line, "AnonHugePages: %lu kB", &kb) == 1)
+			{
+				// the kernel merges neighbouring mappings, only count up to the part that is ours
+				size_t ours = PageAllocation::overlap(start, end, first, last);
+				placement.hugePageBytes += std::min<size_t>((size_t) kb * 1024, ours);
+			}
+			else if (overlaps && sscanf(line, "KernelPageSize: %lu kB", &kb) == 1 && kb * 1024 > smallPage)
+			{
+				// explicit huge pages are not counted in AnonHugePages
+				placement.hugePageBytes += PageAllocation::overlap(start, end, first, last);
+			}
+		}
+		fclose(smaps);
+	}
+
+	size_t pages = (bytes + smallPage - 1) / smallPage;
+	size_t samples = std::min(pages, PageAllocation::placementSamples);
+	if (samples == 0)
+		return placement;
+	std::vector<void*> addresses(samples);
+	std::vector<int> status(samples, -1);
+	for (size_t i = 0; i < samples; i++)
+		addresses[i] = (void*) ((first + i * pages / samples * smallPage) / smallPage * smallPage);
+	if (syscall(SYS_move_pages, 0, samples, addresses.data(), nullptr, status.data(), 0) != 0)
+		return placement;
+	placement.sampledPages = samples;
+	for (int node : status)
+	{
+		if (node < 0)
+		{
+			placement.untouchedPages++;
+			continue;
+		}
+		if ((size_t) node >= placement.pagesPerNode.size())
+			placement.pagesPerNode.resize(node + 1);
+		placement.pagesPerNode[node]++;
+	}
+#endif
+	return placement;
+}
+
+#endif //PAGEALLOCATION_H
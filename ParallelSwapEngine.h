@@ -0,0 +1,152 @@
+#ifndef PARALLELSWAPENGINE_H
+#define PARALLELSWAPENGINE_H
+
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "FastRandom.h"
+#include "HipsTree.h"
+#include "ThreadPool.h"
+
+/*
+ * A swap to do somewhere at a level, either a branch swap or a grandchild swap
+ */
+struct SwapEvent
+{
+	size_t level;
+	bool grandchild;
+};
+
+/*
+ * Parallel swap engine class
+ *
+ * Cuts a tree at a split level into 2^split independent subtrees. A swap at or below the split level only touches the
+ * subtree it lands in, so the engine picks that subtree with its own generator and queues the swap there. Each subtree
+ * has its own generator stream tied to its position, and the queues run on a thread pool. A swap above the split level
+ * crosses subtrees, so the queues are drained first and that swap runs alone from the root.
+ *
+ * The result only depends on the seed and the split level, not on the number of threads. It is not the same sequence
+ * as calling the tree's own swap functions because those draw every branch from the tree's generator.
+ *
+ * With a counter based generator (PhiloxRandom) the engine numbers the events it is given from 0 across calls to run
+ * and every event draws all of its branches, including the ones that choose the subtree, from its own stream. The
+ * result is then also independent of the split level and is exactly the tree a serial run gets from calling
+ * tree.swapEvent(k, level, grandchild) for every event k on a tree seeded with the same seed.
+ */
+template <typename T, typename Rng=randomGenerator, bool ParentLinks=false>
+class ParallelSwapEngine
+{
+public:
+	/*
+	 * Creates an engine for a tree (the tree has to outlive the engine and keep its depth while the engine is used)
+	 */
+	ParallelSwapEngine(HipsTree<T, Rng, ParentLinks>& tree, size_t splitLevel, int randSeed,
+	                   size_t threads=std::thread::hardware_concurrency())
+		: tree(tree), splitLevel(splitLevel), random(randSeed), pool(threads)
+	{
+		if (tree.getDepth() == 0 || splitLevel > tree.getDepth() - 1)
+			throw std::runtime_error("Split level too deep for this tree");
+		size_t subtrees = (size_t) 1 << splitLevel;
+		streams.reserve(subtrees);
+		for (size_t i = 0; i < subtrees; i++)
+			streams.emplace_back(isCounterBased<Rng>::value ? randSeed : randSeed + 1 + (int) i);
+		queues.resize(subtrees);
+		subtreeRoots = tree.nodesAtLevel(splitLevel);
+	}
+	/*
+	 * Does a batch of swaps in order (swaps in different subtrees may run at the same time)
+	 */
+	void run(const std::vector<SwapEvent>& events)
+	{
+		for (const auto& event : events)
+			if (event.level + (event.grandchild ? 2 : 1) > tree.getDepth())
+				throw std::runtime_error("Level too deep for swap");
+		for (const auto& event : events)
+		{
+			uint64_t index = eventCount++;
+			beginEvent(random, index, event.level);
+			if (event.level < splitLevel)
+			{
+				flush();
+				if (event.grandchild)
+					tree.swapRandomGrandchildrenBelow(tree.getRoot(), event.level, random);
+				else
+					tree.swapRandomLevelBelow(tree.getRoot(), event.level, random);
+				// the swap may have moved whole subtrees around
+				subtreeRoots = tree.nodesAtLevel(splitLevel);
+			}
+			else
+			{
+				queues[chooseSubtree(random)].push_back({event, index});
+			}
+		}
+		flush();
+	}
+	/*
+	 * Returns the number of events run so far, the index the next event gets
+	 */
+	uint64_t getEventCount() const
+	{
+		return eventCount;
+	}
+	/*
+	 * Returns the number of threads swaps run on
+	 */
+	size_t getThreads() const
+	{
+		return pool.size();
+	}
+
+private:
+	struct QueuedSwap
+	{
+		SwapEvent event;
+		uint64_t index;
+	};
+
+	static void beginEvent(Rng& rng, uint64_t index, size_t level)
+	{
+		if constexpr (isCounterBased<Rng>::value)
+			rng.beginEvent(index, (uint32_t) level);
+	}
+	// walks the branches above the split level, 1 is left like the tree's own walks
+	size_t chooseSubtree(Rng& rng)
+	{
+		size_t index = 0;
+		for (size_t i = 0; i < splitLevel; i++)
+			index = 2 * index + (rng.getRandInt(1) ? 0 : 1);
+		return index;
+	}
+	void flush()
+	{
+		pool.parallelFor(queues.size(), [this](size_t i) {
+			for (const auto& queued : queues[i])
+			{
+				const SwapEvent& event = queued.event;
+				if constexpr (isCounterBased<Rng>::value)
+				{
+					// replay the branches that chose this subtree so the rest of the walk continues the event's stream
+					beginEvent(streams[i], queued.index, event.level);
+					chooseSubtree(streams[i]);
+				}
+				if (event.grandchild)
+					tree.swapRandomGrandchildrenBelow(subtreeRoots[i], event.level - splitLevel, streams[i]);
+				else
+					tree.swapRandomLevelBelow(subtreeRoots[i], event.level - splitLevel, streams[i]);
+			}
+			queues[i].clear();
+		});
+	}
+
+	HipsTree<T, Rng, ParentLinks>& tree;
+	size_t splitLevel;
+	Rng random;
+	std::vector<Rng> streams;
+	std::vector<std::vector<QueuedSwap>> queues;
+	std::vector<Node<T, ParentLinks>*> subtreeRoots;
+	ThreadPool pool;
+	uint64_t eventCount = 0;
+};
+
+#endif //PARALLELSWAPENGINE_H
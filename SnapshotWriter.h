@@ -0,0 +1,215 @@
+#ifndef SNAPSHOTWRITER_H
+#define SNAPSHOTWRITER_H
+
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "ThreadPool.h"
+
+/*
+ * Snapshot writer class
+ *
+ * Writes time series of leaf values without stopping the swaps for the I/O. submit copies the leaves into one of two
+ * reusable buffers with the tree's snapshot and hands it to a background thread, so the simulation can keep swapping
+ * while the previous snapshot drains. If both buffers are still waiting to be written, submit waits for one to free
+ * up.
+ *
+ * The sink is called on the writer thread with each snapshot and its number, which counts the submits that queued a
+ * snapshot from 0. The file constructor appends each snapshot as raw values to one file. An exception from the sink is
+ * rethrown by the next submit, flush or by finish, and the snapshots queued behind the one that failed are still
+ * written.
+ */
+template <typename T>
+class SnapshotWriter
+{
+public:
+	using Sink = std::function<void(const std::vector<T>& values, size_t index)>;
+
+	/*
+	 * Creates a writer that passes every snapshot to a sink
+	 */
+	explicit SnapshotWriter(Sink sink) : sink(std::move(sink))
+	{
+		writer = std::thread([this]() { writerLoop(); });
+	}
+	/*
+	 * Creates a writer that appends every snapshot to a binary file
+	 */
+	explicit SnapshotWriter(const std::string& path) : SnapshotWriter(fileSink(path)) {}
+	SnapshotWriter(const SnapshotWriter&) = delete;
+	SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+	/*
+	 * Deconstructor writes whatever is still queued
+	 */
+	~SnapshotWriter()
+	{
+		try
+		{
+			finish();
+		}
+		catch (...)
+		{
+		}
+	}
+	/*
+	 * Copies the leaves of a tree into a free buffer and queues it to be written (pool is passed to the snapshot). Throws
+	 * after finish, and if the snapshot throws the buffer is given back before the exception is passed on.
+	 */
+	template <typename Tree>
+	void submit(Tree& tree, ThreadPool* pool=nullptr)
+	{
+		std::vector<T>* buffer = acquireBuffer();
+		try
+		{
+			tree.snapshot(*buffer, pool);
+		}
+		catch (...)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			freeBuffers.push_back(buffer);
+			changed.notify_all();
+			throw;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping)
+		{
+			// finish ran while the snapshot was taken, nothing would write it anymore
+			freeBuffers.push_back(buffer);
+			throw std::runtime_error("Snapshot writer has already finished");
+		}
+		queued.push_back({buffer, submitted++});
+		changed.notify_all();
+	}
+	/*
+	 * Waits until every queued snapshot has been written
+	 */
+	void flush()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [this]() { return queued.empty() && !writing; });
+		rethrowError();
+	}
+	/*
+	 * Writes everything still queued and stops the writer thread
+	 */
+	void finish()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				return;
+			stopping = true;
+		}
+		changed.notify_all();
+		writer.join();
+		std::lock_guard<std::mutex> lock(mutex);
+		rethrowError();
+	}
+	/*
+	 * Returns the number of snapshots the sink took so far (the ones it threw on are not counted)
+	 */
+	size_t getWritten()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return written;
+	}
+
+private:
+	// a filled buffer and the number of the submit that filled it
+	struct Snapshot
+	{
+		std::vector<T>* buffer;
+		size_t index;
+	};
+
+	static Sink fileSink(const std::string& path)
+	{
+		static_assert(std::is_trivially_copyable<T>::value, "Writing to a file needs a trivially copyable type");
+		std::shared_ptr<FILE> file(fopen(path.c_str(), "wb"), [](FILE* f) { if (f != nullptr) fclose(f); });
+		if (!file)
+			throw std::runtime_error("Could not open snapshot file " + path);
+		return [file](const std::vector<T>& values, size_t) {
+			if (fwrite(values.data(), sizeof(T), values.size(), file.get()) != values.size())
+				throw std::runtime_error("Could not write snapshot");
+			fflush(file.get());
+		};
+	}
+	std::vector<T>* acquireBuffer()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (stopping)
+			throw std::runtime_error("Snapshot writer has already finished");
+		rethrowError();
+		// backpressure, wait for the writer to give a buffer back
+		changed.wait(lock, [this]() { return !freeBuffers.empty() || error; });
+		rethrowError();
+		std::vector<T>* buffer = freeBuffers.back();
+		freeBuffers.pop_back();
+		return buffer;
+	}
+	void writerLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			changed.wait(lock, [this]() { return !queued.empty() || stopping; });
+			if (queued.empty())
+				return;
+			Snapshot snapshot = queued.front();
+			queued.erase(queued.begin());
+			writing = true;
+			lock.unlock();
+			std::exception_ptr thrown;
+			try
+			{
+				sink(*snapshot.buffer, snapshot.index);
+			}
+			catch (...)
+			{
+				thrown = std::current_exception();
+			}
+			lock.lock();
+			writing = false;
+			// the first error is the one passed on, the later snapshots are still offered to the sink
+			if (!thrown)
+				written++;
+			else if (!error)
+				error = thrown;
+			freeBuffers.push_back(snapshot.buffer);
+			changed.notify_all();
+		}
+	}
+	void rethrowError()
+	{
+		if (error)
+		{
+			std::exception_ptr thrown = error;
+			error = nullptr;
+			std::rethrow_exception(thrown);
+		}
+	}
+
+	Sink sink;
+	std::vector<T> buffers[2];
+	std::vector<std::vector<T>*> freeBuffers{&buffers[0], &buffers[1]};
+	std::vector<Snapshot> queued;
+	bool writing = false;
+	bool stopping = false;
+	size_t submitted = 0;
+	size_t written = 0;
+	std::exception_ptr error;
+	std::mutex mutex;
+	std::condition_variable changed;
+	std::thread writer;
+};
+
+#endif //SNAPSHOTWRITER_H
@@ -0,0 +1,132 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Thread pool class
+ *
+ * Keeps a fixed set of worker threads around so parallel sections do not pay for starting threads. parallelFor hands
+ * out indices to the workers and the calling thread and returns once every index has run. If a task throws, the first
+ * exception is rethrown on the calling thread after the others finish.
+ */
+class ThreadPool
+{
+public:
+	/*
+	 * Starts a pool that runs tasks on the given number of threads (the calling thread counts as one of them)
+	 */
+	explicit ThreadPool(size_t threads=std::thread::hardware_concurrency())
+	{
+		for (size_t i = 1; i < threads; i++)
+			workers.emplace_back([this]() { workerLoop(); });
+	}
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+	/*
+	 * Deconstructor stops and joins the workers
+	 */
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wake.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+	}
+	/*
+	 * Calls task(i) for every i in [0, count) across the pool and waits for all of them
+	 */
+	void parallelFor(size_t count, const std::function<void(size_t)>& task)
+	{
+		if (workers.empty() || count < 2)
+		{
+			for (size_t i = 0; i < count; i++)
+				task(i);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			currentTask = &task;
+			taskCount = count;
+			nextIndex = 0;
+			busy = workers.size();
+			error = nullptr;
+			generation++;
+		}
+		wake.notify_all();
+		runTasks();
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return busy == 0; });
+		currentTask = nullptr;
+		if (error)
+			std::rethrow_exception(error);
+	}
+	/*
+	 * Returns the number of threads tasks run on
+	 */
+	size_t size() const
+	{
+		return workers.size() + 1;
+	}
+
+private:
+	void workerLoop()
+	{
+		size_t seen = 0;
+		while (true)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&]() { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+			}
+			runTasks();
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--busy == 0)
+					done.notify_all();
+			}
+		}
+	}
+	void runTasks()
+	{
+		for (size_t i = nextIndex++; i < taskCount; i = nextIndex++)
+		{
+			try
+			{
+				(*currentTask)(i);
+			}
+			catch (...)
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				if (!error)
+					error = std::current_exception();
+			}
+		}
+	}
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+	const std::function<void(size_t)>* currentTask = nullptr;
+	size_t taskCount = 0;
+	std::atomic<size_t> nextIndex{0};
+	size_t busy = 0;
+	size_t generation = 0;
+	bool stopping = false;
+	std::exception_ptr error;
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,142 @@
+#ifndef TREESTATS_H
+#define TREESTATS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+/*
+ * Tree statistics
+ *
+ * Filled in by HipsTree when it is compiled with HIPSTREE_STATS defined. Without it the tree keeps no statistics at
+ * all and getStats returns one that is all 0.
+ *
+ * Single swaps are counted per level and kind, and their time is split into walking down to the node and the swap
+ * itself, with a histogram of the whole swap's time. Swaps done by the batch functions are only counted because their
+ * walks are interleaved, the batch calls are timed as a whole. Only the tree's own swap functions are recorded, not the
+ * Below functions other threads use.
+ */
+struct TreeStats
+{
+	static constexpr size_t levels = 64;
+	static constexpr size_t buckets = 32;
+
+	struct LevelStats
+	{
+		uint64_t swaps = 0;
+		uint64_t batched = 0;
+		uint64_t walkNanos = 0;
+		uint64_t swapNanos = 0;
+		// latency[b] counts swaps that took at least 2^(b - 1) and less than 2^b nanoseconds
+		uint64_t latency[buckets] = {};
+	};
+
+	struct Timing
+	{
+		uint64_t calls = 0;
+		uint64_t nanos = 0;
+	};
+
+	LevelStats branchSwaps[levels];
+	LevelStats grandchildSwaps[levels];
+	Timing batches;
+	// inOrderValues and inOrderLeaves
+	Timing traversals;
+	Timing snapshots;
+	// node memory in use and reserved by the arenas when getStats was called
+	uint64_t internalNodeBytes = 0;
+	uint64_t leafBytes = 0;
+	uint64_t reservedBytes = 0;
+
+	/*
+	 * Nanoseconds on a monotonic clock
+	 */
+	static uint64_t now()
+	{
+		return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	void recordSwap(size_t level, bool grandchild, uint64_t start, uint64_t walked, uint64_t end)
+	{
+		LevelStats& stats = (grandchild ? grandchildSwaps : branchSwaps)[level];
+		stats.swaps++;
+		stats.walkNanos += walked - start;
+		stats.swapNanos += end - walked;
+		stats.latency[bucketOf(end - start)]++;
+	}
+	void countBatched(size_t level, bool grandchild)
+	{
+		(grandchild ? grandchildSwaps : branchSwaps)[level].batched++;
+	}
+	static void record(Timing& timing, uint64_t start)
+	{
+		timing.calls++;
+		timing.nanos += now() - start;
+	}
+	void reset()
+	{
+		*this = TreeStats();
+	}
+	/*
+	 * Writes the statistics as a JSON object (levels without any swaps are left out)
+	 */
+	std::string toJson() const
+	{
+		std::ostringstream json;
+		json << "{\"branchSwaps\": ";
+		levelsToJson(json, branchSwaps);
+		json << ", \"grandchildSwaps\": ";
+		levelsToJson(json, grandchildSwaps);
+		json << ", \"batches\": ";
+		timingToJson(json, batches);
+		json << ", \"traversals\": ";
+		timingToJson(json, traversals);
+		json << ", \"snapshots\": ";
+		timingToJson(json, snapshots);
+		json << ", \"internalNodeBytes\": " << internalNodeBytes << ", \"leafBytes\": " << leafBytes
+		     << ", \"reservedBytes\": " << reservedBytes << "}";
+		return json.str();
+	}
+
+private:
+	static size_t bucketOf(uint64_t nanos)
+	{
+		size_t bucket = 0;
+		while (nanos > 0 && bucket + 1 < buckets)
+		{
+			nanos >>= 1;
+			bucket++;
+		}
+		return bucket;
+	}
+	static void levelsToJson(std::ostringstream& json, const LevelStats* stats)
+	{
+		json << "[";
+		bool first = true;
+		for (size_t level = 0; level < levels; level++)
+		{
+			const LevelStats& s = stats[level];
+			if (s.swaps == 0 && s.batched == 0)
+				continue;
+			json << (first ? "" : ", ") << "{\"level\": " << level << ", \"swaps\": " << s.swaps << ", \"batched\": "
+			     << s.batched << ", \"walkNanos\": " << s.walkNanos << ", \"swapNanos\": " << s.swapNanos
+			     << ", \"latency\": [";
+			size_t used = buckets;
+			while (used > 0 && s.latency[used - 1] == 0)
+				used--;
+			for (size_t b = 0; b < used; b++)
+				json << (b > 0 ? ", " : "") << s.latency[b];
+			json << "]}";
+			first = false;
+		}
+		json << "]";
+	}
+	static void timingToJson(std::ostringstream& json, const Timing& timing)
+	{
+		json << "{\"calls\": " << timing.calls << ", \"nanos\": " << timing.nanos << "}";
+	}
+};
+
+#endif //TREESTATS_H
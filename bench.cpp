@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "FlatHipsTree.h"
+#include "HipsTree.h"
+#include "HybridHipsTree.h"
+
+/*
+ * Benchmarks for the trees
+ *
+ * Times populating, swapping at every level, reading the leaves and resetting for a range of depths and prints one
+ * row per measurement as CSV or JSON so runs can be compared.
+ *
+ * hipstree_bench [--min-depth 10] [--max-depth 27] [--swaps 100000] [--budget 0.5]
+ *                [--tree pointer|flat|hybrid|both|all] [--format csv|json]
+ *                [--seed 1] [--pages none|transparent|explicit] [--numa local|interleave]
+ *
+ * Each swap measurement makes up to --swaps swaps and stops early after --budget seconds. A swap near the root of the
+ * flat tree moves half the leaves, so at large depths a fixed count would take hours while the pointer tree's swaps
+ * cost the same at every level. The time per swap is over the swaps actually made.
+ *
+ * --tree both is the pointer and flat trees, all adds the hybrid tree. --pages and --numa set the pointer tree's
+ * memory policy, the others keep their leaves in a std::vector.
+ *
+ * Every configuration runs in the same process, so cumulativePeakRss is the peak of everything benched so far and not
+ * of that row's tree alone. Run one --tree and depth per process for a per configuration peak.
+ */
+
+struct BenchOptions
+{
+	size_t minDepth = 10;
+	size_t maxDepth = 27;
+	size_t swaps = 100000;
+	// seconds one swap measurement may take before it stops early
+	double budget = 0.5;
+	bool pointer = true;
+	bool flat = true;
+	bool hybrid = true;
+	bool json = false;
+	int seed = 1;
+	MemoryPolicy policy;
+};
+
+struct BenchResult
+{
+	std::string tree;
+	size_t depth;
+	std::string metric;
+	long level;
+	double value;
+	std::string unit;
+};
+
+class BenchReport
+{
+public:
+	explicit BenchReport(bool json) : json(json)
+	{
+		if (json)
+			std::cout << "[" << std::endl;
+		else
+			std::cout << "tree,depth,metric,level,value,unit" << std::endl;
+	}
+	~BenchReport()
+	{
+		if (json)
+			std::cout << std::endl << "]" << std::endl;
+	}
+	void add(const BenchResult& result)
+	{
+		if (json)
+		{
+			std::cout << (rows++ > 0 ? ",\n" : "") << "  {\"tree\": \"" << result.tree << "\", \"depth\": "
+			          << result.depth << ", \"metric\": \"" << result.metric << "\", \"level\": " << result.level
+			          << ", \"value\": " << result.value << ", \"unit\": \"" << result.unit << "\"}";
+		}
+		else
+		{
+			std::cout << result.tree << "," << result.depth << "," << result.metric << "," << result.level << ","
+			          << result.value << "," << result.unit << std::endl;
+		}
+	}
+
+private:
+	bool json;
+	size_t rows = 0;
+};
+
+/*
+ * Seconds taken by a function
+ */
+template <typename F>
+double timeIt(F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	f();
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ * Nanoseconds per call of a function called up to count times, stopping early once budget seconds have gone by
+ */
+template <typename F>
+double timePerCall(size_t count, double budget, F f)
+{
+	auto start = std::chrono::steady_clock::now();
+	size_t done = 0;
+	double seconds = 0;
+	// the clock is read after batches that double in size, so slow calls stop soon and fast ones are not slowed by it
+	for (size_t batch = 1; done < count && seconds < budget; batch = std::min(2 * batch, (size_t) 4096))
+	{
+		for (size_t end = std::min(count, done + batch); done < end; done++)
+			f();
+		seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	return seconds * 1e9 / (double) done;
+}
+
+/*
+ * Resident memory right now in bytes (0 where /proc is not there)
+ */
+size_t currentRss()
+{
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm == nullptr)
+		return 0;
+	unsigned long pages = 0, resident = 0;
+	if (fscanf(statm, "%lu %lu", &pages, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/*
+ * Highest resident memory of the process so far in bytes (never goes down, so it covers every earlier configuration)
+ */
+size_t cumulativePeakRss()
+{
+	rusage usage{};
+	getrusage(RUSAGE_SELF, &usage);
+	return (size_t) usage.ru_maxrss * 1024;
+}
+
+void usePolicy(HipsTree<size_t>& tree, const MemoryPolicy& policy)
+{
+	tree.setMemoryPolicy(policy);
+}
+
+template <typename Tree>
+void usePolicy(Tree&, const MemoryPolicy&)
+{
+}
+
+// -1 where the tree has no placement to report
+double hugePageBytes(HipsTree<size_t>& tree)
+{
+	return (double) tree.getPlacement().hugePageBytes;
+}
+
+template <typename Tree>
+double hugePageBytes(Tree&)
+{
+	return -1;
+}
+
+template <typename Tree>
+void benchTree(const std::string& name, size_t depth, const BenchOptions& options, BenchReport& report)
+{
+	size_t leaves = (size_t) 1 << (depth - 1);
+	auto add = [&](const std::string& metric, long level, double value, const std::string& unit) {
+		report.add({name, depth, metric, level, value, unit});
+	};
+
+	std::vector<size_t> values(leaves);
+	for (size_t i = 0; i < leaves; i++)
+		values[i] = i;
+	size_t before = currentRss();
+	Tree tree(options.seed);
+	usePolicy(tree, options.policy);
+	add("populateByVector", -1, timeIt([&]() { tree.populateByVector(values); }), "s");
+	size_t after = currentRss();
+	// resident memory grows a page at a time so this only means something for larger trees
+	if (before > 0 && after > before)
+		add("bytesPerLeaf", -1, (double) (after - before) / (double) leaves, "B");
+	if (hugePageBytes(tree) >= 0)
+		add("hugePageBytes", -1, hugePageBytes(tree), "B");
+	add("populateToLevelValue", -1, timeIt([&]() { tree.populateToLevelValue(depth, 0); }), "s");
+	tree.populateByVector(values);
+
+	for (size_t level = 0; level < depth; level++)
+	{
+		double ns = timePerCall(options.swaps, options.budget, [&]() { tree.swapRandomLevel(level); });
+		add("swapRandomLevel", (long) level, ns, "ns/op");
+	}
+	for (size_t level = 0; level + 1 < depth; level++)
+	{
+		double ns = timePerCall(options.swaps, options.budget, [&]() { tree.swapRandomGrandchildrenLevel(level); });
+		add("swapRandomGrandchildrenLevel", (long) level, ns, "ns/op");
+	}
+
+	std::vector<size_t> ordered;
+	add("inOrderValues", -1, timeIt([&]() { ordered = tree.inOrderValues(); }), "s");
+	size_t sum = 0;
+	double seconds = timeIt([&]() {
+		for (auto it = tree.getIterator(); it.hasNext();)
+			sum += it.next()->getValue();
+	});
+	add("iterator", -1, seconds, "s");
+	// every leaf is visited once whatever the order, anything else means the timing loop was broken
+	if (sum != leaves * (leaves - 1) / 2)
+		throw std::runtime_error("Iterator did not visit every leaf once");
+	add("resetTree", -1, timeIt([&]() { tree.resetTree(); }), "s");
+	add("cumulativePeakRss", -1, (double) cumulativePeakRss(), "B");
+}
+
+bool parseOptions(int argc, char** argv, BenchOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		const char* next = i + 1 < argc ? argv[i + 1] : nullptr;
+		if (next == nullptr)
+			return false;
+		if (arg == "--min-depth")
+			options.minDepth = strtoul(next, nullptr, 10);
+		else if (arg == "--max-depth")
+			options.maxDepth = strtoul(next, nullptr, 10);
+		else if (arg == "--swaps")
+			options.swaps = strtoul(next, nullptr, 10);
+		else if (arg == "--budget")
+			options.budget = atof(next);
+		else if (arg == "--seed")
+			options.seed = atoi(next);
+		else if (arg == "--tree")
+		{
+			bool all = strcmp(next, "all") == 0;
+			bool both = strcmp(next, "both") == 0;
+			options.pointer = all || both || strcmp(next, "pointer") == 0;
+			options.flat = all || both || strcmp(next, "flat") == 0;
+			options.hybrid = all || strcmp(next, "hybrid") == 0;
+		}
+		else if (arg == "--format")
+			options.json = strcmp(next, "json") == 0;
+		else if (arg == "--pages")
+			options.policy.hugePages = strcmp(next, "explicit") == 0 ? HugePages::Explicit
+			                         : strcmp(next, "transparent") == 0 ? HugePages::Transparent : HugePages::None;
+		else if (arg == "--numa")
+			options.policy.interleave = strcmp(next, "interleave") == 0;
+		else
+			return false;
+		i++;
+	}
+	return options.minDepth >= 3 && options.minDepth <= options.maxDepth && options.swaps > 0 && options.budget > 0;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		std::cerr << "usage: " << argv[0] << " [--min-depth 10] [--max-depth 27] [--swaps 100000] [--budget 0.5]"
+		          << " [--tree pointer|flat|hybrid|both|all] [--format csv|json] [--seed 1]"
+		          << " [--pages none|transparent|explicit] [--numa local|interleave]" << std::endl;
+		return 1;
+	}
+
+	BenchReport report(options.json);
+	for (size_t depth = options.minDepth; depth <= options.maxDepth; depth++)
+	{
+		// flat first, its memory is a fraction of the pointer tree's so cumulativePeakRss still shows the larger one
+		if (options.flat)
+			benchTree<FlatHipsTree<size_t>>("flat", depth, options, report);
+		if (options.hybrid)
+			benchTree<HybridHipsTree<size_t>>("hybrid", depth, options, report);
+		if (options.pointer)
+			benchTree<HipsTree<size_t>>("pointer", depth, options, report);
+	}
+	return 0;
+}
@@ -1,6 +1,47 @@
+#include <cstdio>
 #include <iostream>
 
+#include "Checkpoint.h"
+#include "EnsembleRunner.h"
+#include "FastRandom.h"
+#include "FlatHipsTree.h"
+#include "HipsScheduler.h"
 #include "HipsTree.h"
+#include "HybridHipsTree.h"
+#include "MappedHipsTree.h"
+#include "MultiScalarHipsTree.h"
+#include "ParallelSwapEngine.h"
+#include "SnapshotWriter.h"
+
+#ifdef DOMPI
+#include "DistributedHipsTree.h"
+
+// starts and stops MPI like in BYUIgnite:SEC
+processor proc;
+
+/*
+ * Every rank holds one subtree of a tree, all ranks make the same calls
+ */
+void distributedExample()
+{
+	DistributedHipsTree<size_t> tree(1);
+	std::vector<size_t> values(8);
+	for (size_t i = 0; i < values.size(); i++)
+		values[i] = proc.myid * values.size() + i;
+	tree.populateByVector(values);
+	for (size_t i = 0; i < 1000; i++)
+		tree.swapRandomGrandchildrenLevel(i % (tree.getDepth() - 1));
+	std::vector<size_t> ordered = tree.inOrderValues();
+	if (proc.myid == 0)
+	{
+		std::cout << " === Distributed Tree ===" << std::endl << std::endl;
+		std::cout << "Tree over " << proc.nproc << " ranks after 1000 grandchild swaps:";
+		for (size_t value : ordered)
+			std::cout << " " << value;
+		std::cout << std::endl << std::endl;
+	}
+}
+#endif
 
 void printLargeTree(const std::shared_ptr<HipsTree<size_t>>& tree, size_t numPrint)
 {
@@ -8,15 +49,22 @@ void printLargeTree(const std::shared_ptr<HipsTree<size_t>>& tree, size_t numPri
 	for (size_t i = 0; i < numPrint; i++)
 		std::cout << it.next()->getValue() << " ";
 	std::cout << "... ";
-	for (size_t i = 0; i < ((size_t) pow(2, (double) tree->getDepth() - 1) - 2 * numPrint); i++)
-		it.next();
-	for (size_t i = 0; i < numPrint; i++)
-		std::cout << it.next()->getValue() << " ";
+	// jump straight to the last leaves instead of walking past the ones in between
+	size_t numLeaves = (size_t) pow(2, (double) tree->getDepth() - 1);
+	for (auto last = tree->iteratorAt(numLeaves - numPrint); last != tree->end(); ++last)
+		std::cout << *last << " ";
 	std::cout << std::endl;
 }
 
 int main()
 {
+#ifdef DOMPI
+	distributedExample();
+	// the rest runs on one rank
+	if (proc.myid != 0)
+		return 0;
+#endif
+
 	std::cout << " === Populate Tree ===" << std::endl << std::endl;
 
 	/*
@@ -95,6 +143,14 @@ int main()
 	std::cout << "Leaf nodes by iterator: ";
 	while (treeIterator.hasNext())
 		std::cout << treeIterator.next()->getValue() << " ";
+	std::cout << std::endl;
+
+	/*
+	 * The tree also works with range-for and <algorithm> (the values can be modified through a non-const tree)
+	 */
+	std::cout << "Leaf values by range-for: ";
+	for (const auto& value : *tree)
+		std::cout << value << " ";
 	std::cout << std::endl << std::endl;
 
 	/*
@@ -129,5 +185,201 @@ int main()
 			printLargeTree(tree, numberOfSpacesToPrint);
 	}
 
+	/*
+	 * A flat tree keeps only the leaves in one array and swaps blocks of leaves instead of rewiring nodes (much less
+	 * memory and getting the values is a single copy). Given the same seed it gives the same leaf order as HipsTree.
+	 */
+	std::cout << std::endl << " === Flat Tree ===" << std::endl << std::endl;
+
+	auto flatTree = FlatHipsTree<size_t>::getTree({0, 1, 2, 3, 4, 5, 6, 7});
+	flatTree->swapRandomGrandchildrenLevel(0);
+	std::cout << "Flat tree with grandchild swap at root: " << flatTree->toString() << std::endl;
+
+	// its iterator and inOrderLeaves give leaf handles with the same getValue/setValue as the nodes of a HipsTree
+	flatTree->inOrderLeaves().at(0)->setValue(100);
+	std::cout << "Flat leaves by iterator after a value changed: ";
+	for (auto flatIterator = flatTree->getIterator(); flatIterator.hasNext();)
+		std::cout << flatIterator.next()->getValue() << " ";
+	std::cout << std::endl;
+
+	// with lazy swaps a branch swap only toggles a bit, the leaves are put in order when they are read
+	flatTree->setLazySwaps(true);
+	for (size_t i = 0; i < 1000; i++)
+		flatTree->swapRandom();
+	std::cout << "Flat tree after 1000 lazy swaps: " << flatTree->toString() << std::endl;
+
+	// the leaves under one node (one eddy) can be looked at in place, for a flat tree they are one block of the array
+	auto eddy = flatTree->subtree(1, 0);
+	std::cout << "Leaves under the left child of the root:";
+	for (size_t value : eddy)
+		std::cout << " " << value;
+	std::cout << std::endl;
+
+	/*
+	 * Swaps in different subtrees can run at the same time, the engine splits the tree at a level and runs the swaps
+	 * below it on a thread pool (the result depends on the seed but not on the number of threads)
+	 */
+	std::cout << std::endl << " === Parallel Swaps ===" << std::endl << std::endl;
+
+	tree->populateByVector(values);
+	ParallelSwapEngine<size_t> engine(*tree, 4, 1);
+	std::vector<SwapEvent> events;
+	for (size_t i = 0; i < 10000; i++)
+		events.push_back({i % (tree->getDepth() - 2), true});
+	engine.run(events);
+	std::cout << "Tree after " << events.size() << " parallel grandchild swaps on " << engine.getThreads() << " threads:" << std::endl;
+	if (printTree)
+		printLargeTree(tree, numberOfSpacesToPrint);
+
+	/*
+	 * A scheduler runs grandchild swaps at each level as a Poisson process with a rate per level
+	 */
+	std::cout << std::endl << " === Scheduled Swaps ===" << std::endl << std::endl;
+
+	auto rates = HipsScheduler<size_t>::geometricRates(tree->getDepth() - 2, 1.0, 2.0);
+	HipsScheduler<size_t> scheduler(*tree, rates, 1);
+	size_t scheduledSwaps = scheduler.advance(10.0);
+	std::cout << "Tree after " << scheduledSwaps << " swaps up to time " << scheduler.getTime() << ":" << std::endl;
+	if (printTree)
+		printLargeTree(tree, numberOfSpacesToPrint);
+
+	/*
+	 * An ensemble runs many realizations with different seeds in one process and reduces a statistic over them between
+	 * steps (tree i gets seed 1 + i, the same as a separate run with that seed)
+	 */
+	std::cout << std::endl << " === Ensemble ===" << std::endl << std::endl;
+
+	EnsembleRunner<FlatHipsTree<size_t>> ensemble(32, 1);
+	ensemble.populateByVector(values);
+	auto series = ensemble.run(3, [](FlatHipsTree<size_t>& realization, size_t) {
+		for (size_t i = 0; i < 1000; i++)
+			realization.swapRandomGrandchildrenLevel(i % (realization.getDepth() - 2));
+	}, [](FlatHipsTree<size_t>& realization, size_t) {
+		// the value of the first leaf is the position it started at
+		return (double) realization.leafAt(0);
+	});
+	for (size_t s = 0; s < series.size(); s++)
+		std::cout << "After step " << s + 1 << " the first leaf over " << series[s].count << " realizations is "
+		          << series[s].mean << " +- " << series[s].standardError() << std::endl;
+
+	/*
+	 * The generator is a template parameter, a faster one gives a different sequence than the default for the same seed
+	 */
+	std::cout << std::endl << " === Generator Policy ===" << std::endl << std::endl;
+
+	auto fastTree = FlatHipsTree<size_t, BitBufferedRng<Xoshiro256ss>>::getTree({0, 1, 2, 3, 4, 5, 6, 7}, 1);
+	for (size_t i = 0; i < 1000; i++)
+		fastTree->swapRandom();
+	std::cout << "Flat tree after 1000 swaps with xoshiro256**: " << fastTree->toString() << std::endl;
+
+	/*
+	 * A hybrid tree keeps the top levels as a table of blocks, a swap there exchanges handles and a swap below moves
+	 * leaves inside one block (the block size follows from the depth and the size of the values)
+	 */
+	std::cout << std::endl << " === Hybrid Tree ===" << std::endl << std::endl;
+
+	auto hybridTree = HybridHipsTree<size_t>::getTree(values, 1);
+	for (size_t i = 0; i < 1000; i++)
+		hybridTree->swapRandomGrandchildrenLevel(i % (hybridTree->getDepth() - 2));
+	std::cout << "Hybrid tree with " << hybridTree->getDepth() << " levels has a table down to level "
+	          << hybridTree->getBlockLevel() << " over blocks of " << hybridTree->getBlockSize() << " leaves" << std::endl;
+
+	/*
+	 * Trees bigger than memory can keep their leaves in a mapped file, only a table of blocks stays in RAM
+	 */
+	std::cout << std::endl << " === Mapped Tree ===" << std::endl << std::endl;
+
+	{
+		MappedHipsTree<size_t> mappedTree("hipstree_leaves.bin", 1, 4 * sizeof(size_t));
+		mappedTree.populateByVector({0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15});
+		for (size_t i = 0; i < 1000; i++)
+			mappedTree.swapRandom();
+		std::cout << "Mapped tree after 1000 swaps with blocks of " << mappedTree.getBlockSize() << " leaves: "
+		          << mappedTree.toString() << std::endl;
+		mappedTree.resetTree();
+	}
+	std::remove("hipstree_leaves.bin");
+
+	/*
+	 * Parcels with many scalars keep each scalar in its own array indexed by parcel, the tree only moves parcel indices
+	 * and mixing averages every field of the parcels a bottom level grandchild swap brings together
+	 */
+	std::cout << std::endl << " === Multi Scalar Tree ===" << std::endl << std::endl;
+
+	MultiScalarHipsTree<double> scalarTree(2, 1);
+	scalarTree.populateToLevel(4);
+	// field 0 is a temperature that starts hot on the left, field 1 marks parcel 0
+	scalarTree.setField(0, {1, 1, 1, 1, 0, 0, 0, 0});
+	scalarTree.setField(1, {1, 0, 0, 0, 0, 0, 0, 0});
+	scalarTree.setMixingRule(MixingRule::FullAverage);
+	for (size_t i = 0; i < 100; i++)
+		scalarTree.swapRandomGrandchildrenLevel(i % (scalarTree.getDepth() - 2));
+	std::cout << "Temperature in tree order:";
+	for (double value : scalarTree.inOrderField(0))
+		std::cout << " " << value;
+	std::cout << std::endl;
+	std::cout << "Mean temperature " << scalarTree.fieldMean(0) << " (mixing keeps it), parcel 0 is now at position "
+	          << scalarTree.positionOf(0) << std::endl;
+
+	/*
+	 * A checkpoint saves the leaves and the generator state, a run restarted from it makes exactly the same swaps
+	 */
+	std::cout << std::endl << " === Checkpoint ===" << std::endl << std::endl;
+
+	writeCheckpoint(*tree, "hipstree_checkpoint.bin");
+	for (size_t i = 0; i < 1000; i++)
+		tree->swapRandomGrandchildrenLevel(i % (tree->getDepth() - 2));
+	auto restored = HipsTree<size_t>::getTree(2);
+	readCheckpoint(*restored, "hipstree_checkpoint.bin");
+	for (size_t i = 0; i < 1000; i++)
+		restored->swapRandomGrandchildrenLevel(i % (restored->getDepth() - 2));
+	std::cout << "Restored tree made the same 1000 swaps: "
+	          << (restored->inOrderValues() == tree->inOrderValues() ? "yes" : "no") << std::endl;
+	std::remove("hipstree_checkpoint.bin");
+
+	/*
+	 * A snapshot writer copies the leaves into a buffer and writes them on its own thread, so the swaps go on while the
+	 * previous snapshot is written (here the sink only adds them up, the path constructor appends them to a file)
+	 */
+	std::cout << std::endl << " === Snapshot Writer ===" << std::endl << std::endl;
+
+	{
+		SnapshotWriter<size_t> snapshots([](const std::vector<size_t>& snapshot, size_t index) {
+			size_t sum = 0;
+			for (size_t value : snapshot)
+				sum += value;
+			std::cout << "Snapshot " << index << " has " << snapshot.size() << " leaves adding up to " << sum
+			          << std::endl;
+		});
+		for (size_t s = 0; s < 3; s++)
+		{
+			for (size_t i = 0; i < 1000; i++)
+				tree->swapRandomGrandchildrenLevel(i % (tree->getDepth() - 2));
+			snapshots.submit(*tree);
+		}
+		snapshots.finish();
+	}
+
+	/*
+	 * Large trees can put their nodes in huge pages (fewer TLB misses on every walk) and spread them over NUMA nodes,
+	 * the placement says what the kernel actually gave
+	 */
+	std::cout << std::endl << " === Memory Policy ===" << std::endl << std::endl;
+
+	auto hugeTree = HipsTree<size_t>::getTree(1);
+	MemoryPolicy policy;
+	policy.hugePages = HugePages::Transparent;
+	policy.interleave = true;
+	ThreadPool pool;
+	hugeTree->setMemoryPolicy(policy, &pool);
+	hugeTree->populateToLevelValue(16, 0);
+	std::cout << "Tree with 16 levels: " << hugeTree->getPlacement().toString() << std::endl;
+
+#ifdef HIPSTREE_STATS
+	// swap counts and timings per level of everything the big tree did above
+	std::cout << std::endl << " === Statistics ===" << std::endl << std::endl;
+	std::cout << tree->getStats().toJson() << std::endl;
+#endif
+
 	return 0;
 }
@@ -10,6 +10,8 @@
 
 #pragma once
 
+#include <cstdint>
+
 #include "MersenneTwister.h"
 #include "processor.h"
 
@@ -42,4 +44,20 @@ public :
 			mtwist.seed();
 	}
 	randomGenerator()          : mtwist() {}
+
+	// Saving and loading the generator state (not in the BYUIgnite:SEC version, added so runs can be checkpointed)
+	static const int stateSize = MTRand::SAVE;   ///< number of 32 bit words in a saved state
+
+	inline void save(uint32_t* state) const {
+		MTRand::uint32 words[MTRand::SAVE];
+		mtwist.save(words);
+		for(int i = 0; i < stateSize; i++)
+			state[i] = (uint32_t) words[i];
+	}
+	inline void load(const uint32_t* state) {
+		MTRand::uint32 words[MTRand::SAVE];
+		for(int i = 0; i < stateSize; i++)
+			words[i] = state[i];
+		mtwist.load(words);
+	}
 };
\ No newline at end of file